@@ -0,0 +1,107 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "hashtable.h"
+
+#define MAX_CPUS 1024     // Highest CPU number looked at, plus one
+
+// NUMA topology straight from sysfs, so nothing beyond libc is needed.
+// Memory placement follows from Linux's first-touch policy: a page lands
+// on the node of the thread that first writes it, so pinned threads that
+// allocate their own slabs and shards get node-local memory.
+static int cpu_nodes[MAX_CPUS];
+static int topology_read;
+
+// Parses a sysfs cpulist such as "0-3,8-11" and marks its CPUs as node
+static void mark_cpulist(const char *list, int node) {
+    const char *p = list;
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p) break;
+        if (*end == '-') hi = strtol(end + 1, &end, 10);
+        for (; lo <= hi && lo < MAX_CPUS; lo++) {
+            cpu_nodes[lo] = node;
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+}
+
+static void read_topology() {
+    char path[64], list[4096];
+    int node;
+    if (topology_read) return;
+    topology_read = 1;
+    // CPUs outside any node directory count as node 0
+    for (node = 0; node < MAX_NODES; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        if (fgets(list, sizeof(list), f)) mark_cpulist(list, node);
+        fclose(f);
+    }
+}
+
+int cpu_node(int cpu) {
+    read_topology();
+    return cpu >= 0 && cpu < MAX_CPUS ? cpu_nodes[cpu] : 0;
+}
+
+// Fills cpus[0..n) with the CPU for each of n workers, drawn from the CPUs
+// this process may run on. "compact" fills one node before the next,
+// "scatter" deals workers round-robin over the nodes. With more workers
+// than CPUs the plan wraps around.
+void plan_cpus(const char *policy, int n, int *cpus) {
+    cpu_set_t allowed;
+    int order[MAX_CPUS];
+    int count = 0, cpu, node, i;
+
+    read_topology();
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        panic("cannot read the CPU affinity mask");
+    }
+    // Allowed CPUs sorted by node, then by number
+    for (node = 0; node < MAX_NODES; node++) {
+        for (cpu = 0; cpu < MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && cpu_nodes[cpu] == node) order[count++] = cpu;
+        }
+    }
+    if (count == 0) panic("no CPUs to pin to");
+
+    if (strcmp(policy, "scatter") == 0) {
+        // Reorder as the first CPU of every node, then every second, ...
+        int scattered[MAX_CPUS];
+        int taken = 0, round;
+        for (round = 0; taken < count; round++) {
+            for (node = 0; node < MAX_NODES; node++) {
+                int k, seen = 0;
+                for (k = 0; k < count; k++) {
+                    if (cpu_nodes[order[k]] == node && seen++ == round) {
+                        scattered[taken++] = order[k];
+                        break;
+                    }
+                }
+            }
+        }
+        memcpy(order, scattered, sizeof(int) * count);
+    } else if (strcmp(policy, "compact") != 0) {
+        panic("affinity must be none, compact or scatter");
+    }
+    for (i = 0; i < n; i++) {
+        cpus[i] = order[i % count];
+    }
+}
+
+// Pins the calling thread to cpu
+void pin_self(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        panic("cannot pin thread");
+    }
+}
@@ -0,0 +1,1195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "hashtable.h"
+
+#define STRIPES_PER_THREAD 4 // Lock stripes per thread unless given explicitly
+#define MAX_BATCH 1024    // Largest accepted -b value
+#define MAX_SWEEP 64      // Most thread counts in one sweep
+#define CHUNK_KEYS 1024   // Key positions per work-stealing chunk
+#define HOT_OPS_PERCENT 90  // Share of hotspot operations that hit the hot keys
+#define HOT_KEYS_PERCENT 10 // Share of the keys that are hot
+#define READ_CHECK 256    // Lookups between checks of the -D stop flag
+#define MAX_LINE 1024     // Longest baseline CSV line
+
+// Every table implementation linked into this binary
+static const ht_backend *backends[] = {
+    &unsync_backend,
+    &private_backend,
+    &mutex_backend,
+    &mcs_backend,
+    &ticket_backend,
+    &adaptive_backend,
+    &elided_backend,
+    &spin_backend,
+    &rwlock_backend,
+    &twolevel_backend,
+    &compact_backend,
+    &wide_backend,
+    &lockfree_backend,
+    &probe_backend,
+    &seqlock_backend,
+    &sharded_backend,
+    &inline_backend,
+};
+#define NUM_BACKENDS (int) (sizeof(backends) / sizeof(backends[0]))
+
+// Run settings, read by the phase threads
+static const ht_backend *backend;
+static int num_threads = 1;
+static long num_keys = 100000;
+static int batch_size = 64;
+static int *keys;
+static int *bulk_vals;    // Values for -B, the key positions
+static int *worker_cpus;  // CPU of each worker, NULL when unpinned
+
+// Mixed workload: operation i applies mix_ops[i] to mix_keys[i]. Drawn up
+// front so the timed phase runs no RNG.
+enum { MIX_GET, MIX_PUT, MIX_REMOVE, MIX_ADD };
+static int *mix_keys;
+static char *mix_ops;
+
+void panic(char *msg) {
+    printf("%s\n", msg);
+    exit(1);
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+#ifdef HT_STATS
+// Log-linear latency histogram in nanoseconds: values below HIST_SUB are
+// exact, above that every power of two is split into HIST_SUB buckets,
+// so each bucket is within 1/HIST_SUB of the values it holds
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+enum { OP_INSERT, OP_RETRIEVE, OP_REMOVE, OP_UPDATE, NUM_OPS };
+static const char *op_names[NUM_OPS] = {"insert", "retrieve", "remove", "update"};
+
+typedef struct latency_hist {
+    unsigned long count[HIST_BUCKETS];
+} latency_hist;
+
+__thread ht_stats thread_stats;
+static __thread latency_hist thread_hist[NUM_OPS];
+
+// Totals for the current configuration, merged from every phase thread
+static pthread_mutex_t totals_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ht_stats total_stats;
+static latency_hist total_hist[NUM_OPS];
+
+long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int hist_index(unsigned long v) {
+    if (v < HIST_SUB) return v;
+    int shift = 63 - __builtin_clzl(v) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + ((v >> shift) & (HIST_SUB - 1));
+}
+
+// Smallest value that lands in bucket i
+unsigned long hist_value(int i) {
+    if (i < HIST_SUB) return i;
+    int shift = (i >> HIST_SUB_BITS) - 1;
+    return (unsigned long) (HIST_SUB + (i & (HIST_SUB - 1))) << shift;
+}
+
+unsigned long hist_percentile(const latency_hist *h, double p) {
+    unsigned long total = 0, seen = 0;
+    int i;
+    for (i = 0; i < HIST_BUCKETS; i++) total += h->count[i];
+    if (total == 0) return 0;
+    unsigned long rank = (unsigned long) ceil(p * total);
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen >= rank && seen > 0) return hist_value(i);
+    }
+    return hist_value(HIST_BUCKETS - 1);
+}
+
+// Times one backend call into the calling thread's histogram for op
+#define TIMED(op, call) do { \
+        long t0 = now_ns(); \
+        call; \
+        thread_hist[op].count[hist_index(now_ns() - t0)]++; \
+    } while (0)
+
+// Adds the calling thread's counters to the totals and clears them
+void merge_thread_stats() {
+    int op, i;
+    pthread_mutex_lock(&totals_mutex);
+    total_stats.lock_acquires += thread_stats.lock_acquires;
+    total_stats.lock_contended += thread_stats.lock_contended;
+    total_stats.spin_iterations += thread_stats.spin_iterations;
+    total_stats.tx_commits += thread_stats.tx_commits;
+    total_stats.tx_aborts += thread_stats.tx_aborts;
+    for (op = 0; op < NUM_OPS; op++) {
+        for (i = 0; i < HIST_BUCKETS; i++) {
+            total_hist[op].count[i] += thread_hist[op].count[i];
+        }
+    }
+    pthread_mutex_unlock(&totals_mutex);
+    memset(&thread_stats, 0, sizeof(thread_stats));
+    memset(thread_hist, 0, sizeof(thread_hist));
+}
+
+// Prints the merged totals of one configuration to stderr and resets them,
+// keeping stdout parseable as plain CSV/JSON
+void report_stats(const char *name) {
+    int op;
+    for (op = 0; op < NUM_OPS; op++) {
+        fprintf(stderr, "# %s threads=%d %s_ns p50=%lu p99=%lu p999=%lu max=%lu\n",
+                name, num_threads, op_names[op],
+                hist_percentile(&total_hist[op], 0.5), hist_percentile(&total_hist[op], 0.99),
+                hist_percentile(&total_hist[op], 0.999), hist_percentile(&total_hist[op], 1.0));
+    }
+    fprintf(stderr, "# %s threads=%d lock_acquires=%lu lock_contended=%lu spin_iterations=%lu "
+            "tx_commits=%lu tx_aborts=%lu\n",
+            name, num_threads, total_stats.lock_acquires, total_stats.lock_contended,
+            total_stats.spin_iterations, total_stats.tx_commits, total_stats.tx_aborts);
+    memset(&total_stats, 0, sizeof(total_stats));
+    memset(total_hist, 0, sizeof(total_hist));
+}
+#else
+#define TIMED(op, call) call
+#define merge_thread_stats() ((void) 0)
+#define report_stats(name) ((void) 0)
+#endif
+
+// Hardware and scheduler counters (-p) through perf_event_open(2). Each
+// phase thread opens a set on itself, so the counts follow it across CPUs
+// and leave out every other thread, and reports what each phase cost it.
+// A counter the kernel refuses (no PMU in a VM, perf_event_paranoid)
+// reads as 0 after a note on stderr.
+enum { PERF_CYCLES, PERF_CACHE_MISSES, PERF_CTX_SWITCHES, NUM_PERF };
+static const char *perf_names[NUM_PERF] = {"cycles", "cache_misses", "ctx_switches"};
+
+typedef struct perf_set {
+    int fd[NUM_PERF];
+} perf_set;
+
+static int perf_enabled;
+static int perf_warned;   // Bit per counter already reported unavailable
+
+// Opens the calling thread's counters, also counting the threads it
+// starts from now on if inherit is set. Without -p every counter is off.
+void perf_open(perf_set *p, int inherit) {
+    static const struct { unsigned type; unsigned long config; } events[NUM_PERF] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    };
+    int i;
+    for (i = 0; i < NUM_PERF; i++) {
+        struct perf_event_attr attr;
+        p->fd[i] = -1;
+        if (!perf_enabled) continue;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.inherit = inherit;
+        attr.exclude_hv = 1;
+        p->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (p->fd[i] < 0) {
+            // Unprivileged users may still count user space
+            attr.exclude_kernel = 1;
+            p->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+        if (p->fd[i] < 0 &&
+            !(__atomic_fetch_or(&perf_warned, 1 << i, __ATOMIC_RELAXED) & (1 << i))) {
+            fprintf(stderr, "# perf counter %s unavailable, reporting 0\n", perf_names[i]);
+        }
+    }
+}
+
+// Reads the running counts into out[]
+void perf_read(const perf_set *p, unsigned long *out) {
+    int i;
+    for (i = 0; i < NUM_PERF; i++) {
+        out[i] = 0;
+        if (p->fd[i] >= 0 && read(p->fd[i], &out[i], sizeof(out[i])) != sizeof(out[i])) {
+            out[i] = 0;
+        }
+    }
+}
+
+void perf_close(perf_set *p) {
+    int i;
+    for (i = 0; i < NUM_PERF; i++) {
+        if (p->fd[i] >= 0) close(p->fd[i]);
+    }
+}
+
+// Rounds n up to the next power of two
+int round_up_pow2(int n) {
+    int p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+// Phase kernels: each applies one phase to the key positions [lo, hi) and
+// returns the gets that missed. tid only tags the inserted values.
+long put_range(long lo, long hi, long tid) {
+    long key;
+    int batch_keys[MAX_BATCH], batch_vals[MAX_BATCH];
+    int n = 0;
+
+    for (key = lo; key < hi; key++) {
+        if (batch_size == 1) {
+            TIMED(OP_INSERT, backend->insert(keys[key], tid));
+            continue;
+        }
+        batch_keys[n] = keys[key];
+        batch_vals[n++] = tid;
+        if (n == batch_size) {
+            TIMED(OP_INSERT, backend->insert_batch(batch_keys, batch_vals, n));
+            n = 0;
+        }
+    }
+    if (n > 0) TIMED(OP_INSERT, backend->insert_batch(batch_keys, batch_vals, n));
+    return 0;
+}
+
+long get_range(long lo, long hi, long tid) {
+    long key;
+    long lost = 0;
+    int batch_keys[MAX_BATCH], vals[MAX_BATCH];
+    bool found[MAX_BATCH];
+    bool hit;
+    size_t hits;
+    int n = 0;
+    (void) tid;           // Only put_range() uses it, as the value
+
+    for (key = lo; key < hi; key++) {
+        if (batch_size == 1) {
+            TIMED(OP_RETRIEVE, hit = backend->retrieve_into(keys[key], &vals[0]));
+            if (!hit) lost++;
+            continue;
+        }
+        batch_keys[n++] = keys[key];
+        if (n == batch_size) {
+            TIMED(OP_RETRIEVE, hits = backend->retrieve_batch(batch_keys, vals, found, n));
+            lost += n - hits;
+            n = 0;
+        }
+    }
+    if (n > 0) {
+        TIMED(OP_RETRIEVE, hits = backend->retrieve_batch(batch_keys, vals, found, n));
+        lost += n - hits;
+    }
+    return lost;
+}
+
+// Runs the mixed operation stream, counting gets that miss. With removes
+// in the mix, misses are expected.
+long mix_range(long lo, long hi, long tid) {
+    long op;
+    long lost = 0;
+    int val;
+    bool hit;
+
+    for (op = lo; op < hi; op++) {
+        if (mix_ops[op] == MIX_PUT) {
+            TIMED(OP_INSERT, backend->insert(mix_keys[op], tid));
+        } else if (mix_ops[op] == MIX_REMOVE) {
+            TIMED(OP_REMOVE, backend->remove(mix_keys[op]));
+        } else if (mix_ops[op] == MIX_ADD) {
+            TIMED(OP_UPDATE, ht_fetch_add(backend, mix_keys[op], 1));
+        } else {
+            TIMED(OP_RETRIEVE, hit = backend->retrieve_into(mix_keys[op], &val));
+            if (!hit) lost++;
+        }
+    }
+    return lost;
+}
+
+// Async kernel (-A): the get phase, or the mixed stream's gets and puts,
+// submitted through ht_async with up to batch_size requests in flight,
+// waiting for each window before starting the next
+long async_range(long lo, long hi, long tid) {
+    ht_future futures[MAX_BATCH];
+    bool is_get[MAX_BATCH];
+    long op;
+    long lost = 0;
+    int n = 0, i;
+
+    for (op = lo; op < hi; op++) {
+        if (mix_ops != NULL && mix_ops[op] == MIX_PUT) {
+            ht_async_put(mix_keys[op], tid, &futures[n]);
+            is_get[n++] = false;
+        } else {
+            ht_async_get(mix_ops != NULL ? mix_keys[op] : keys[op], &futures[n]);
+            is_get[n++] = true;
+        }
+        if (n == batch_size || op + 1 == hi) {
+            TIMED(OP_RETRIEVE, for (i = 0; i < n; i++) {
+                    if (!ht_async_wait(&futures[i]) && is_get[i]) lost++;
+                });
+            n = 0;
+        }
+    }
+    return lost;
+}
+
+typedef long (*phase_fn)(long lo, long hi, long tid);
+
+// Persistent worker pool. The phase's positions are cut into CHUNK_KEYS
+// chunks and dealt out in contiguous runs, one work-stealing deque per
+// worker. A worker pops chunks from the bottom of its own deque and, once
+// that is empty, steals from the top of the others, so a slow worker
+// doesn't set the phase time. Chunks are only added between phases, so a
+// deque is a fixed array that never grows.
+typedef struct worker {
+    long top;             // Next chunk thieves take, advanced by CAS
+    long bottom __attribute__((aligned(CACHE_LINE)));  // One past the owner's next chunk
+    long *chunks;         // Chunk indices, filled before each phase
+    long lost;            // Result of the last phase
+    long ops;             // Key positions the last phase ran here
+    unsigned long perf[NUM_PERF];  // Counts of the last phase
+    pthread_t thread;
+} __attribute__((aligned(CACHE_LINE))) worker;
+
+static worker *workers;
+static phase_fn current_phase;  // NULL tells the workers to exit
+static pthread_barrier_t phase_start, phase_done;
+
+// Chase-Lev pop from the owner's end; returns -1 when the deque is empty
+long take_chunk(worker *w) {
+    long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+    if (t > b) {
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    long c = w->chunks[b];
+    if (t == b) {
+        // Last chunk, race the thieves for it
+        if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            c = -1;
+        }
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return c;
+}
+
+// Chase-Lev steal from the far end; returns -1 when the deque is empty and
+// -2 when another thread got there first
+long steal_chunk(worker *w) {
+    long t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) return -1;
+    long c = w->chunks[t];
+    if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return -2;
+    }
+    return c;
+}
+
+// Runs phase over chunk c, counting its positions into *ops
+long run_chunk(phase_fn phase, long c, long tid, long *ops) {
+    long lo = c * CHUNK_KEYS;
+    long hi = lo + CHUNK_KEYS < num_keys ? lo + CHUNK_KEYS : num_keys;
+    *ops += hi - lo;
+    return phase(lo, hi, tid);
+}
+
+void * worker_loop(void *arg) {
+    long tid = (long) arg;
+    worker *self = &workers[tid];
+    perf_set perf;
+
+    // Pin before the first allocation so per-thread slabs are node-local
+    if (worker_cpus != NULL) pin_self(worker_cpus[tid]);
+    perf_open(&perf, 0);
+
+    for (;;) {
+        pthread_barrier_wait(&phase_start);
+        phase_fn phase = current_phase;
+        if (phase == NULL) break;
+
+        long c, lost = 0, ops = 0;
+        int i, busy;
+        unsigned long start[NUM_PERF];
+        perf_read(&perf, start);
+        while ((c = take_chunk(self)) >= 0) {
+            lost += run_chunk(phase, c, tid, &ops);
+        }
+        // Own deque is empty, steal until every deque is
+        do {
+            busy = 0;
+            for (i = 1; i < num_threads; i++) {
+                worker *victim = &workers[(tid + i) % num_threads];
+                while ((c = steal_chunk(victim)) != -1) {
+                    busy = 1;
+                    if (c < 0) continue;
+                    lost += run_chunk(phase, c, tid, &ops);
+                }
+            }
+        } while (busy);
+
+        // Make posted operations visible before the next phase reads them
+        if (backend->flush != NULL) backend->flush();
+        perf_read(&perf, self->perf);
+        for (i = 0; i < NUM_PERF; i++) {
+            self->perf[i] -= start[i];
+        }
+        self->lost = lost;
+        self->ops = ops;
+        merge_thread_stats();
+        pthread_barrier_wait(&phase_done);
+    }
+    perf_close(&perf);
+    return NULL;
+}
+
+// Starts num_threads workers, which wait for the first phase
+void pool_start() {
+    long i;
+    long num_chunks = (num_keys + CHUNK_KEYS - 1) / CHUNK_KEYS;
+    workers = aligned_alloc(CACHE_LINE, sizeof(worker) * num_threads);
+    if (!workers) {
+        panic("out of memory allocating workers");
+    }
+    pthread_barrier_init(&phase_start, NULL, num_threads + 1);
+    pthread_barrier_init(&phase_done, NULL, num_threads + 1);
+    for (i = 0; i < num_threads; i++) {
+        workers[i].chunks = (long *) malloc(sizeof(long) * num_chunks);
+        if (!workers[i].chunks) {
+            panic("out of memory allocating work deques");
+        }
+        pthread_create(&workers[i].thread, NULL, worker_loop, (void *)i);
+    }
+}
+
+void pool_stop() {
+    long i;
+    current_phase = NULL;
+    pthread_barrier_wait(&phase_start);
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        free(workers[i].chunks);
+    }
+    pthread_barrier_destroy(&phase_start);
+    pthread_barrier_destroy(&phase_done);
+    free(workers);
+}
+
+// Runs one phase on the pool and returns its wall time. The gets that
+// missed are summed into *total, the positions each NUMA node's workers
+// ran are added to node_ops[] and the workers' counters to perf[].
+double run_phase(phase_fn phase, long *total, long *node_ops, unsigned long *perf) {
+    long i, c;
+    int e;
+    long num_chunks = (num_keys + CHUNK_KEYS - 1) / CHUNK_KEYS;
+
+    // Deal the chunks out in contiguous runs
+    for (i = 0; i < num_threads; i++) {
+        workers[i].top = 0;
+        workers[i].bottom = 0;
+    }
+    for (c = 0; c < num_chunks; c++) {
+        worker *w = &workers[c * num_threads / num_chunks];
+        w->chunks[w->bottom++] = c;
+    }
+    current_phase = phase;
+
+    double start = now();
+    pthread_barrier_wait(&phase_start);
+    pthread_barrier_wait(&phase_done);
+    double end = now();
+
+    *total = 0;
+    for (i = 0; i < num_threads; i++) {
+        *total += workers[i].lost;
+        node_ops[worker_cpus != NULL ? cpu_node(worker_cpus[i]) : 0] += workers[i].ops;
+        for (e = 0; e < NUM_PERF; e++) {
+            perf[e] += workers[i].perf[e];
+        }
+    }
+    return end - start;
+}
+
+// Fixed-duration read phase (-D). Instead of a pass over the keys, a
+// reader per worker loops over retrieve_into() on the finished table,
+// each from its own start position, until the main thread sets read_stop.
+// Each reader times itself from the start barrier, so thread creation is
+// left out and every reader's rate is its own.
+typedef struct reader {
+    pthread_t thread;
+    long tid;
+    long ops;             // Lookups done
+    long lost;            // Lookups that missed
+    double seconds;       // Time the reader ran
+    unsigned long perf[NUM_PERF];  // Counts over that time
+} __attribute__((aligned(CACHE_LINE))) reader;
+
+static double read_seconds;  // Length of the read phase, 0 unless -D is given
+static int read_stop;
+static pthread_barrier_t read_start;
+
+void * reader_loop(void *arg) {
+    reader *self = arg;
+    long i = self->tid * num_keys / num_threads, ops = 0, lost = 0;
+    int n, val;
+    bool hit;
+    perf_set perf;
+    unsigned long counts[NUM_PERF];
+
+    if (worker_cpus != NULL) pin_self(worker_cpus[self->tid]);
+    perf_open(&perf, 0);
+    pthread_barrier_wait(&read_start);
+    perf_read(&perf, counts);
+    double start = now();
+    while (!__atomic_load_n(&read_stop, __ATOMIC_RELAXED)) {
+        for (n = 0; n < READ_CHECK; n++) {
+            TIMED(OP_RETRIEVE, hit = backend->retrieve_into(keys[i], &val));
+            if (!hit) lost++;
+            if (++i == num_keys) i = 0;
+        }
+        ops += READ_CHECK;
+    }
+    self->seconds = now() - start;
+    perf_read(&perf, self->perf);
+    for (n = 0; n < NUM_PERF; n++) {
+        self->perf[n] -= counts[n];
+    }
+    perf_close(&perf);
+    self->ops = ops;
+    self->lost = lost;
+    merge_thread_stats();
+    return NULL;
+}
+
+// Runs num_threads readers for read_seconds. Adds each reader's rate to
+// thread_mops[] (millions of lookups per second), its lookups to its NUMA
+// node's node_ops[] and its counters to perf[], sums the misses into
+// *total and returns the aggregate rate.
+double run_reads(double *thread_mops, long *total, long *node_ops, unsigned long *perf) {
+    long i;
+    int e;
+    double sum = 0;
+    reader *readers = aligned_alloc(CACHE_LINE, sizeof(reader) * num_threads);
+    if (!readers) {
+        panic("out of memory allocating readers");
+    }
+    read_stop = 0;
+    pthread_barrier_init(&read_start, NULL, num_threads + 1);
+    for (i = 0; i < num_threads; i++) {
+        readers[i].tid = i;
+        pthread_create(&readers[i].thread, NULL, reader_loop, &readers[i]);
+    }
+    pthread_barrier_wait(&read_start);
+    struct timespec ts = {(time_t) read_seconds,
+                          (long) ((read_seconds - (time_t) read_seconds) * 1e9)};
+    nanosleep(&ts, NULL);
+    __atomic_store_n(&read_stop, 1, __ATOMIC_RELAXED);
+
+    *total = 0;
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(readers[i].thread, NULL);
+        double mops = readers[i].ops / readers[i].seconds / 1e6;
+        thread_mops[i] += mops;
+        sum += mops;
+        *total += readers[i].lost;
+        node_ops[worker_cpus != NULL ? cpu_node(worker_cpus[i]) : 0] += readers[i].ops;
+        for (e = 0; e < NUM_PERF; e++) {
+            perf[e] += readers[i].perf[e];
+        }
+    }
+    pthread_barrier_destroy(&read_start);
+    free(readers);
+    return sum;
+}
+
+// Prints the table's memory footprint to stderr (-M): bytes per key, the
+// breakdown behind it and the chain-length histogram, shortest first
+void report_memory(const char *name) {
+    ht_mem_stats st;
+    int i;
+    backend->mem_stats(&st);
+    size_t total = st.index_bytes + st.entry_bytes + st.overhead_bytes;
+    fprintf(stderr, "# %s threads=%d keys=%ld bytes_per_key=%.1f index_bytes=%zu "
+            "entry_bytes=%zu overhead_bytes=%zu chains=",
+            name, num_threads, st.keys, st.keys > 0 ? (double) total / st.keys : 0,
+            st.index_bytes, st.entry_bytes, st.overhead_bytes);
+    for (i = 0; i < HT_CHAIN_HIST; i++) {
+        fprintf(stderr, "%s%ld", i > 0 ? "/" : "", st.chains[i]);
+    }
+    fprintf(stderr, "\n");
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of n sorted samples
+double percentile(const double *sorted, int n, double p) {
+    int rank = (int) ceil(p * n);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// Parses a comma-separated list of positive ints into out[], returns the count
+int parse_list(char *arg, int *out, int max) {
+    int n = 0;
+    char *tok;
+    for (tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        if (n == max || (out[n] = atoi(tok)) <= 0) {
+            panic("thread counts must be a comma-separated list of positive numbers");
+        }
+        n++;
+    }
+    return n;
+}
+
+// Seeded generator (-R) for everything the harness draws. Each use gets
+// its own stream of the seed, so a run is reproducible, no draw goes
+// through libc's locked random(), and a longer key set doesn't shift the
+// mixed stream. The timed phases draw nothing: their keys and operations
+// are drawn here up front.
+enum { STREAM_KEYS, STREAM_MIX };
+
+typedef struct rng {
+    unsigned long state;
+} rng;
+
+rng rng_stream(unsigned long seed, int stream) {
+    rng g = {seed + (unsigned long) stream * 0xd1342543de82ef95UL};
+    return g;
+}
+
+// splitmix64
+unsigned long rng_next(rng *g) {
+    unsigned long z = (g->state += 0x9e3779b97f4a7c15UL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+    return z ^ (z >> 31);
+}
+
+// Returns a uniform double in [0, 1)
+double rng_unit(rng *g) {
+    return (rng_next(g) >> 11) * (1.0 / (1UL << 53));
+}
+
+// Returns a uniform random index in [0, n)
+long random_index(rng *g, long n) {
+    return (long) (rng_unit(g) * n);
+}
+
+// Fills mix_keys/mix_ops with num_keys operations over keys[]: get_pct
+// percent gets, remove_pct percent removes, add_pct percent counter
+// increments and the rest puts, keys picked by the named distribution.
+// zipf ranks keys[i] i-th most popular with exponent theta; hotspot sends
+// HOT_OPS_PERCENT of the operations to the first HOT_KEYS_PERCENT of keys.
+void build_mix(rng *g, int get_pct, int remove_pct, int add_pct, const char *dist,
+               double theta) {
+    long i;
+    double *cdf = NULL;
+    long hot = num_keys * HOT_KEYS_PERCENT / 100;
+    if (hot == 0) hot = 1;
+
+    mix_keys = (int *) malloc(sizeof(int) * num_keys);
+    mix_ops = (char *) malloc(num_keys);
+    if (!mix_keys || !mix_ops) {
+        panic("out of memory allocating mixed workload");
+    }
+
+    if (strcmp(dist, "zipf") == 0) {
+        double sum = 0;
+        cdf = (double *) malloc(sizeof(double) * num_keys);
+        if (!cdf) {
+            panic("out of memory allocating zipf table");
+        }
+        for (i = 0; i < num_keys; i++) {
+            sum += 1.0 / pow(i + 1, theta);
+            cdf[i] = sum;
+        }
+        for (i = 0; i < num_keys; i++) {
+            cdf[i] /= sum;
+        }
+    } else if (strcmp(dist, "hotspot") != 0 && strcmp(dist, "uniform") != 0) {
+        panic("distribution must be uniform, zipf or hotspot");
+    }
+
+    for (i = 0; i < num_keys; i++) {
+        long k;
+        if (cdf != NULL) {
+            // Binary search for the first rank whose cdf covers u
+            double u = rng_unit(g);
+            long lo = 0, hi = num_keys - 1;
+            while (lo < hi) {
+                long mid = (lo + hi) / 2;
+                if (cdf[mid] < u) lo = mid + 1; else hi = mid;
+            }
+            k = lo;
+        } else if (strcmp(dist, "hotspot") == 0 && hot < num_keys) {
+            if (random_index(g, 100) < HOT_OPS_PERCENT) {
+                k = random_index(g, hot);
+            } else {
+                k = hot + random_index(g, num_keys - hot);
+            }
+        } else {
+            k = random_index(g, num_keys);
+        }
+        mix_keys[i] = keys[k];
+        long op = random_index(g, 100);
+        mix_ops[i] = op < get_pct ? MIX_GET : op < get_pct + remove_pct ? MIX_REMOVE :
+                     op < get_pct + remove_pct + add_pct ? MIX_ADD : MIX_PUT;
+    }
+    free(cdf);
+}
+
+// Regression check (-C) against a baseline: the CSV of an earlier run
+// with the same options. Rows are matched on strategy and threads.
+typedef struct baseline_row {
+    char strategy[32];
+    int threads;
+    double put_s;         // put_median_s
+    double second;        // The second phase's metric, see load_baseline()
+} baseline_row;
+
+static baseline_row *baseline;
+static int baseline_len;
+static double threshold = 10;  // Percent of throughput a metric may lose (-T)
+
+// Loads the rows of path, taking the second phase from the column named
+// second
+void load_baseline(const char *path, const char *second) {
+    char line[MAX_LINE];
+    char *tok;
+    int col, strategy_col = -1, threads_col = -1, put_col = -1, second_col = -1;
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        panic("cannot open baseline");
+    }
+    if (!fgets(line, sizeof(line), f)) {
+        panic("baseline is empty");
+    }
+    for (col = 0, tok = strtok(line, ",\n"); tok != NULL; col++, tok = strtok(NULL, ",\n")) {
+        if (strcmp(tok, "strategy") == 0) strategy_col = col;
+        if (strcmp(tok, "threads") == 0) threads_col = col;
+        if (strcmp(tok, "put_median_s") == 0) put_col = col;
+        if (strcmp(tok, second) == 0) second_col = col;
+    }
+    if (strategy_col < 0 || threads_col < 0 || put_col < 0 || second_col < 0) {
+        panic("baseline columns don't match this run's options");
+    }
+    while (fgets(line, sizeof(line), f)) {
+        baseline = realloc(baseline, sizeof(baseline_row) * (baseline_len + 1));
+        if (!baseline) {
+            panic("out of memory allocating baseline");
+        }
+        baseline_row *row = &baseline[baseline_len++];
+        memset(row, 0, sizeof(*row));
+        for (col = 0, tok = strtok(line, ",\n"); tok != NULL; col++, tok = strtok(NULL, ",\n")) {
+            if (col == strategy_col) snprintf(row->strategy, sizeof(row->strategy), "%s", tok);
+            if (col == threads_col) row->threads = atoi(tok);
+            if (col == put_col) row->put_s = atof(tok);
+            if (col == second_col) row->second = atof(tok);
+        }
+    }
+    fclose(f);
+}
+
+// Prints a line to stderr and returns 1 if the metric lost more than
+// threshold percent of its baseline throughput. Times are inverted, so
+// both kinds of metric compare as throughput.
+int regressed(const char *name, const char *metric, double base, double cur, int rate) {
+    if (base <= 0 || cur <= 0) return 0;
+    double change = rate ? cur / base : base / cur;
+    if (change >= 1 - threshold / 100) return 0;
+    fprintf(stderr, "# REGRESSION %s threads=%d %s baseline=%f now=%f throughput=%+.1f%%\n",
+            name, num_threads, metric, base, cur, (change - 1) * 100);
+    return 1;
+}
+
+// Checks one configuration's medians against its baseline row and
+// returns the number of metrics that regressed
+int check_baseline(const char *name, double put_s, const char *second, double value) {
+    int i;
+    for (i = 0; i < baseline_len; i++) {
+        if (strcmp(baseline[i].strategy, name) == 0 && baseline[i].threads == num_threads) break;
+    }
+    if (i == baseline_len) {
+        fprintf(stderr, "# %s threads=%d not in baseline\n", name, num_threads);
+        return 0;
+    }
+    return regressed(name, "put_median_s", baseline[i].put_s, put_s, 0) +
+           regressed(name, second, baseline[i].second, value, read_seconds > 0);
+}
+
+void usage() {
+    panic("usage: ./bench [-s strategy,...|all] [-t threads,...] [-k keys] [-r reps]\n"
+          "               [-S stripes] [-b batch] [-f csv|json]\n"
+          "               [-m get_percent] [-x remove_percent] [-u add_percent]\n"
+          "               [-d uniform|zipf|hotspot] [-z theta] [-a none|compact|scatter]\n"
+          "               [-w snapshot_path] [-B]\n"
+          "               [-D read_seconds] [-A] [-M] [-R seed] [-p]\n"
+          "               [-C baseline.csv] [-T percent]");
+}
+
+int main(int argc, char **argv) {
+    long i;
+    int opt, b, t, r;
+    char *strategies = "all";
+    int sweep[MAX_SWEEP] = {1, 2, 4, 8};
+    int sweep_len = 4;
+    int reps = 5;
+    int stripes = 0;
+    int json = 0;
+    int rows = 0;
+    int get_pct = -1;     // Mixed workload off unless -m is given
+    int remove_pct = 0;
+    int add_pct = 0;      // fetch_add(key, 1) share of the mix if -u is given
+    char *dist = "uniform";
+    double theta = 0.99;
+    char *affinity = "none";
+    char *snapshot = NULL;  // Warm start through this file if -w is given
+    int bulk = 0;           // Put phase is one backend->build() if -B is given
+    int async = 0;          // Second phase goes through ht_async if -A is given
+    int memory = 0;         // Report the table's footprint if -M is given
+    unsigned long seed = 1; // Keys and mixed stream are drawn from this (-R)
+    char *baseline_path = NULL;  // Check for regressions against this if -C is given
+    int regressions = 0;
+
+    while ((opt = getopt(argc, argv, "s:t:k:r:S:b:f:m:x:u:d:z:a:w:BD:AMR:pC:T:")) != -1) {
+        switch (opt) {
+        case 's': strategies = optarg; break;
+        case 't': sweep_len = parse_list(optarg, sweep, MAX_SWEEP); break;
+        case 'k': num_keys = atol(optarg); break;
+        case 'r': reps = atoi(optarg); break;
+        case 'S': stripes = atoi(optarg); break;
+        case 'b': batch_size = atoi(optarg); break;
+        case 'f': json = strcmp(optarg, "json") == 0; break;
+        case 'm': get_pct = atoi(optarg); break;
+        case 'x': remove_pct = atoi(optarg); break;
+        case 'u': add_pct = atoi(optarg); break;
+        case 'd': dist = optarg; break;
+        case 'z': theta = atof(optarg); break;
+        case 'a': affinity = optarg; break;
+        case 'w': snapshot = optarg; break;
+        case 'B': bulk = 1; break;
+        case 'D': read_seconds = atof(optarg); break;
+        case 'A': async = 1; break;
+        case 'M': memory = 1; break;
+        case 'R': seed = strtoul(optarg, NULL, 0); break;
+        case 'p': perf_enabled = 1; break;
+        case 'C': baseline_path = optarg; break;
+        case 'T': threshold = atof(optarg); break;
+        default: usage();
+        }
+    }
+    if (optind != argc || num_keys <= 0 || reps <= 0 || stripes < 0 ||
+        batch_size <= 0 || batch_size > MAX_BATCH || get_pct > 100 || theta <= 0 ||
+        remove_pct < 0 || add_pct < 0 ||
+        ((remove_pct > 0 || add_pct > 0) &&
+         (get_pct < 0 || get_pct + remove_pct + add_pct > 100)) ||
+        read_seconds < 0 || (read_seconds > 0 && get_pct >= 0) ||
+        threshold < 0 || threshold >= 100 ||
+        (async && (read_seconds > 0 || remove_pct > 0 || add_pct > 0))) {
+        usage();
+    }
+
+    // The second phase's result column, also its baseline metric
+    const char *second = read_seconds > 0 ? "read_mops_median" :
+                         get_pct >= 0 ? "mix_median_s" : "get_median_s";
+    if (baseline_path != NULL) {
+        load_baseline(baseline_path, second);
+    }
+
+    // Initialize random keys, shared by every run; non-negative like
+    // random()'s, so they never collide with a table's empty marker
+    keys = (int *) malloc(sizeof(int) * num_keys);
+    if (!keys) {
+        panic("out of memory allocating keys");
+    }
+    rng key_rng = rng_stream(seed, STREAM_KEYS);
+    for (i = 0; i < num_keys; i++) {
+        keys[i] = (int) (rng_next(&key_rng) >> 33);
+    }
+    if (get_pct >= 0) {
+        rng mix_rng = rng_stream(seed, STREAM_MIX);
+        build_mix(&mix_rng, get_pct, remove_pct, add_pct, dist, theta);
+    }
+    if (bulk) {
+        bulk_vals = (int *) malloc(sizeof(int) * num_keys);
+        if (!bulk_vals) {
+            panic("out of memory allocating values");
+        }
+        for (i = 0; i < num_keys; i++) {
+            bulk_vals[i] = i;
+        }
+    }
+
+    double *put_times = (double *) malloc(sizeof(double) * reps);
+    double *get_times = (double *) malloc(sizeof(double) * reps);  // Mixed phase if -m
+    double *read_mops = (double *) malloc(sizeof(double) * reps);  // Aggregate rates if -D
+    if (!put_times || !get_times || !read_mops) {
+        panic("out of memory allocating timings");
+    }
+
+    if (json) {
+        printf("[\n");
+    } else if (read_seconds > 0) {
+        printf("strategy,threads,stripes,keys,reps,put_median_s,put_p99_s,read_s,"
+               "read_mops_median,read_mops_per_thread,scaling,lost\n");
+    } else if (get_pct >= 0) {
+        printf("strategy,threads,stripes,keys,reps,get_pct,remove_pct,add_pct,dist,put_median_s,"
+               "put_p99_s,mix_median_s,mix_p99_s,lost\n");
+    } else {
+        printf("strategy,threads,stripes,keys,reps,put_median_s,put_p99_s,"
+               "get_median_s,get_p99_s,lost\n");
+    }
+
+    for (b = 0; b < NUM_BACKENDS; b++) {
+        backend = backends[b];
+        if (strcmp(strategies, "all") != 0) {
+            // Match whole names in the comma-separated list
+            const char *p = strstr(strategies, backend->name);
+            size_t len = strlen(backend->name);
+            while (p && ((p != strategies && p[-1] != ',') ||
+                         (p[len] != '\0' && p[len] != ','))) {
+                p = strstr(p + 1, backend->name);
+            }
+            if (!p) continue;
+        }
+        if (remove_pct > 0 && backend->remove == NULL) continue;
+        if (add_pct > 0 && backend->upsert == NULL) continue;
+        if (snapshot != NULL && backend->save == NULL) continue;
+        if (bulk && backend->build == NULL) continue;
+        // Private tables take distinct keys, one writer each, so a mix
+        // that puts and updates shared keys would only measure lost writes
+        if (get_pct >= 0 && backend == &private_backend) continue;
+
+        // -D scaling is per-thread throughput relative to the first
+        // thread count of the sweep, 1 by default
+        double base_mops = 0;
+
+        for (t = 0; t < sweep_len; t++) {
+            ht_config cfg;
+            long lost, max_lost = 0;
+            long node_ops[2][MAX_NODES] = {{0}};
+            unsigned long perf[2][NUM_PERF] = {{0}};
+            double phase_total[2] = {0, 0};
+            double save_total = 0, load_total = 0;
+            double *thread_mops = NULL;
+
+            num_threads = sweep[t];
+            if (strcmp(affinity, "none") != 0) {
+                worker_cpus = (int *) malloc(sizeof(int) * num_threads);
+                if (!worker_cpus) {
+                    panic("out of memory allocating CPU plan");
+                }
+                plan_cpus(affinity, num_threads, worker_cpus);
+            }
+            cfg.cpus = worker_cpus;
+            cfg.num_threads = num_threads;
+            cfg.num_stripes = round_up_pow2(stripes ? stripes : num_threads * STRIPES_PER_THREAD);
+            cfg.expected_keys = num_keys;
+            if (read_seconds > 0) {
+                thread_mops = (double *) calloc(num_threads, sizeof(double));
+                if (!thread_mops) {
+                    panic("out of memory allocating reader rates");
+                }
+            }
+
+            for (r = 0; r < reps; r++) {
+                if (bulk) {
+                    // The put phase is the whole build, started before
+                    // the pool so the builder threads have the CPUs.
+                    // Its counters inherit into the builders, which
+                    // have exited by the time they are read.
+                    perf_set build_perf;
+                    unsigned long before[NUM_PERF], after[NUM_PERF];
+                    int e;
+                    perf_open(&build_perf, 1);
+                    perf_read(&build_perf, before);
+                    double t0 = now();
+                    backend->build(&cfg, keys, bulk_vals, num_keys);
+                    put_times[r] = now() - t0;
+                    perf_read(&build_perf, after);
+                    perf_close(&build_perf);
+                    for (e = 0; e < NUM_PERF; e++) {
+                        perf[0][e] += after[e] - before[e];
+                    }
+                    pool_start();
+                } else {
+                    backend->init(&cfg);
+                    pool_start();
+                    put_times[r] = run_phase(put_range, &lost, node_ops[0], perf[0]);
+                }
+                if (snapshot != NULL) {
+                    // Restart from the snapshot, so the second phase runs
+                    // against a table that was loaded rather than filled
+                    double t0 = now();
+                    backend->save(snapshot);
+                    save_total += now() - t0;
+                    backend->destroy();
+                    t0 = now();
+                    backend->load(&cfg, snapshot);
+                    load_total += now() - t0;
+                }
+                // In mixed mode the put phase prefills every key, then
+                // the mixed stream runs against the full table
+                if (read_seconds > 0) {
+                    read_mops[r] = run_reads(thread_mops, &lost, node_ops[1], perf[1]);
+                    get_times[r] = read_seconds;
+                } else if (async) {
+                    // One queue and drainer per worker, on the worker's CPU
+                    ht_async_init(backend, num_threads, worker_cpus);
+                    get_times[r] = run_phase(async_range, &lost, node_ops[1], perf[1]);
+                    ht_async_destroy();
+                } else {
+                    get_times[r] = run_phase(get_pct >= 0 ? mix_range : get_range, &lost,
+                                             node_ops[1], perf[1]);
+                }
+                if (lost > max_lost) max_lost = lost;
+                phase_total[0] += put_times[r];
+                phase_total[1] += get_times[r];
+                // Once per configuration, on the table as the last
+                // rep left it
+                if (memory && r == reps - 1 && backend->mem_stats != NULL) {
+                    report_memory(backend->name);
+                }
+                pool_stop();
+                backend->destroy();
+            }
+            qsort(put_times, reps, sizeof(double), compare_doubles);
+            qsort(get_times, reps, sizeof(double), compare_doubles);
+            qsort(read_mops, reps, sizeof(double), compare_doubles);
+
+            double mops = read_seconds > 0 ? percentile(read_mops, reps, 0.5) : 0;
+            if (t == 0) base_mops = mops / num_threads;
+            double scaling = base_mops > 0 ? mops / num_threads / base_mops : 0;
+
+            if (json && read_seconds > 0) {
+                printf("%s  {\"strategy\": \"%s\", \"threads\": %d, \"stripes\": %d, "
+                       "\"keys\": %ld, \"reps\": %d, \"put_median_s\": %f, \"put_p99_s\": %f, "
+                       "\"read_s\": %f, \"read_mops_median\": %f, "
+                       "\"read_mops_per_thread\": %f, \"scaling\": %f, \"lost\": %ld}",
+                       rows ? ",\n" : "", backend->name, num_threads, cfg.num_stripes,
+                       num_keys, reps, percentile(put_times, reps, 0.5),
+                       percentile(put_times, reps, 0.99), read_seconds, mops,
+                       mops / num_threads, scaling, max_lost);
+            } else if (json && get_pct >= 0) {
+                printf("%s  {\"strategy\": \"%s\", \"threads\": %d, \"stripes\": %d, "
+                       "\"keys\": %ld, \"reps\": %d, \"get_pct\": %d, \"remove_pct\": %d, "
+                       "\"add_pct\": %d, \"dist\": \"%s\", "
+                       "\"put_median_s\": %f, \"put_p99_s\": %f, \"mix_median_s\": %f, "
+                       "\"mix_p99_s\": %f, \"lost\": %ld}",
+                       rows ? ",\n" : "", backend->name, num_threads, cfg.num_stripes,
+                       num_keys, reps, get_pct, remove_pct, add_pct, dist, percentile(put_times, reps, 0.5),
+                       percentile(put_times, reps, 0.99), percentile(get_times, reps, 0.5),
+                       percentile(get_times, reps, 0.99), max_lost);
+            } else if (json) {
+                printf("%s  {\"strategy\": \"%s\", \"threads\": %d, \"stripes\": %d, "
+                       "\"keys\": %ld, \"reps\": %d, \"put_median_s\": %f, \"put_p99_s\": %f, "
+                       "\"get_median_s\": %f, \"get_p99_s\": %f, \"lost\": %ld}",
+                       rows ? ",\n" : "", backend->name, num_threads, cfg.num_stripes,
+                       num_keys, reps, percentile(put_times, reps, 0.5),
+                       percentile(put_times, reps, 0.99), percentile(get_times, reps, 0.5),
+                       percentile(get_times, reps, 0.99), max_lost);
+            } else if (read_seconds > 0) {
+                printf("%s,%d,%d,%ld,%d,%f,%f,%f,%f,%f,%f,%ld\n",
+                       backend->name, num_threads, cfg.num_stripes, num_keys, reps,
+                       percentile(put_times, reps, 0.5), percentile(put_times, reps, 0.99),
+                       read_seconds, mops, mops / num_threads, scaling, max_lost);
+            } else if (get_pct >= 0) {
+                printf("%s,%d,%d,%ld,%d,%d,%d,%d,%s,%f,%f,%f,%f,%ld\n",
+                       backend->name, num_threads, cfg.num_stripes, num_keys, reps,
+                       get_pct, remove_pct, add_pct, dist, percentile(put_times, reps, 0.5),
+                       percentile(put_times, reps, 0.99), percentile(get_times, reps, 0.5),
+                       percentile(get_times, reps, 0.99), max_lost);
+            } else {
+                printf("%s,%d,%d,%ld,%d,%f,%f,%f,%f,%ld\n",
+                       backend->name, num_threads, cfg.num_stripes, num_keys, reps,
+                       percentile(put_times, reps, 0.5), percentile(put_times, reps, 0.99),
+                       percentile(get_times, reps, 0.5), percentile(get_times, reps, 0.99),
+                       max_lost);
+            }
+            fflush(stdout);
+            report_stats(backend->name);
+            if (perf_enabled) {
+                // Mean counts per rep, summed over the phase's threads
+                int e;
+                for (i = 0; i < 2; i++) {
+                    fprintf(stderr, "# %s threads=%d %s", backend->name, num_threads, i == 0 ?
+                            "put" : read_seconds > 0 ? "read" : get_pct >= 0 ? "mix" : "get");
+                    for (e = 0; e < NUM_PERF; e++) {
+                        fprintf(stderr, " %s=%lu", perf_names[e], perf[i][e] / reps);
+                    }
+                    fprintf(stderr, "\n");
+                }
+            }
+            if (baseline != NULL) {
+                regressions += check_baseline(backend->name, percentile(put_times, reps, 0.5),
+                                              second, read_seconds > 0 ? mops :
+                                              percentile(get_times, reps, 0.5));
+            }
+            if (snapshot != NULL) {
+                fprintf(stderr, "# %s threads=%d save_s=%f load_s=%f\n", backend->name,
+                        num_threads, save_total / reps, load_total / reps);
+            }
+            if (thread_mops != NULL) {
+                // Each reader's mean rate over the reps
+                for (i = 0; i < num_threads; i++) {
+                    fprintf(stderr, "# %s threads=%d reader%ld read_mops=%.3f\n",
+                            backend->name, num_threads, i, thread_mops[i] / reps);
+                }
+                free(thread_mops);
+            }
+            if (worker_cpus != NULL) {
+                // Per-node throughput goes to stderr like the stats lines
+                int node;
+                for (node = 0; node < MAX_NODES; node++) {
+                    if (node_ops[0][node] == 0 && node_ops[1][node] == 0) continue;
+                    fprintf(stderr, "# %s threads=%d node%d put_mops=%.3f %s_mops=%.3f\n",
+                            backend->name, num_threads, node,
+                            node_ops[0][node] / phase_total[0] / 1e6,
+                            read_seconds > 0 ? "read" : get_pct >= 0 ? "mix" : "get",
+                            node_ops[1][node] / phase_total[1] / 1e6);
+                }
+                free(worker_cpus);
+                worker_cpus = NULL;
+            }
+            rows++;
+        }
+    }
+    if (json) {
+        printf("%s]\n", rows ? "\n" : "");
+    }
+
+    // Cleanup
+    free(put_times);
+    free(get_times);
+    free(read_mops);
+    free(keys);
+    free(bulk_vals);
+    free(mix_keys);
+    free(mix_ops);
+    free(baseline);
+
+    // Nonzero so scripts and make stop on a regression
+    return regressions > 0;
+}
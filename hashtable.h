@@ -0,0 +1,327 @@
+#ifndef HASHTABLE_H
+#define HASHTABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <malloc.h>
+#include <pthread.h>
+
+#define CACHE_LINE 64     // Bytes per cache line
+#define MAX_NODES 64      // NUMA nodes looked for
+
+// Settings shared by every backend, filled in by the harness
+typedef struct ht_config {
+    int num_threads;      // Worker threads that will use the table
+    int num_stripes;      // Lock stripes or segments, always a power of two
+    long expected_keys;   // Keys the run will insert, for fixed-size tables
+    const int *cpus;      // CPU of each worker thread, NULL when unpinned
+} ht_config;
+
+// Read-modify-write step for upsert. Called with the key's current value
+// in *val, or with found false and *val 0 if the key is missing. Returns
+// true to store *val as the key's value, inserting the key if needed, or
+// false to leave the table unchanged. Backends call it under the key's
+// lock, from a shard's owner thread or, in lock-free code, again on every
+// failed CAS, so it must compute only from its arguments, and must not
+// block or use the table itself.
+typedef bool (*ht_update_fn)(int *val, bool found, void *arg);
+
+// Memory footprint of a table, filled in by mem_stats. Bytes per key is
+// the three byte counts summed over keys. Chained tables count their
+// buckets by chain length in chains[]; open-addressing tables count their
+// keys by probe distance from the home slot. The last of chains[] also
+// counts everything longer.
+#define HT_CHAIN_HIST 8
+
+typedef struct ht_mem_stats {
+    long keys;              // Keys in the table
+    size_t index_bytes;     // Bucket heads, lock stripes and other per-table arrays
+    size_t entry_bytes;     // Entries or slots that hold a key
+    size_t overhead_bytes;  // Allocated beyond those: free slab space and slots,
+                            // removed entries, malloc headers and rounding
+    long chains[HT_CHAIN_HIST];
+} ht_mem_stats;
+
+// One hash table implementation. Every operation may be called from any
+// number of threads between init() and destroy(). remove is NULL for
+// backends that cannot delete keys. flush, if set, makes every operation
+// the calling thread has issued visible to all threads; the harness calls
+// it at the end of each phase. save and load are NULL unless the backend
+// has a snapshot format: save writes the table to a file while no
+// operations are running, and load is used instead of init to start from
+// such a file. build, if set, is also used instead of init when every key
+// is known up front: it starts a table holding keys[i] -> vals[i] for
+// i < n, built by cfg->num_threads threads, later duplicates winning.
+// insert_batch and retrieve_batch do n inserts or lookups in one call,
+// so a backend can prefetch ahead and take each lock once per group of
+// keys: insert_batch stores batch_keys[i] -> batch_vals[i] as n calls to
+// insert would, and retrieve_batch copies the value of each key found to
+// vals_out[i], sets found[i], and returns how many of the keys were found.
+// upsert applies fn to key's value atomically, taking the key's lock once
+// (or one CAS, or one shard request), and returns what fn returned;
+// ht_fetch_add() and ht_compare_and_set() below are built on it.
+// mem_stats, if set, measures the table while no operations are running.
+typedef struct ht_backend {
+    const char *name;
+    void (*init)(const ht_config *cfg);
+    void (*insert)(int key, int val);
+    bool (*retrieve_into)(int key, int *val_out);
+    void (*insert_batch)(const int *batch_keys, const int *batch_vals, size_t n);
+    size_t (*retrieve_batch)(const int *batch_keys, int *vals_out, bool *found, size_t n);
+    bool (*remove)(int key);
+    bool (*upsert)(int key, ht_update_fn fn, void *arg);
+    void (*flush)(void);
+    void (*save)(const char *path);
+    void (*load)(const ht_config *cfg, const char *path);
+    void (*build)(const ht_config *cfg, const int *keys, const int *vals, size_t n);
+    void (*mem_stats)(ht_mem_stats *out);
+    void (*destroy)(void);
+} ht_backend;
+
+extern const ht_backend unsync_backend;    // parallel_hashtable.c
+extern const ht_backend private_backend;   // parallel_hashtable.c
+extern const ht_backend mutex_backend;     // parallel_mutex.c
+extern const ht_backend mcs_backend;       // parallel_mutex.c
+extern const ht_backend ticket_backend;    // parallel_mutex.c
+extern const ht_backend adaptive_backend;  // parallel_mutex.c
+extern const ht_backend elided_backend;    // parallel_mutex.c
+extern const ht_backend spin_backend;      // parallel_spin.c
+extern const ht_backend rwlock_backend;    // mutex_parallel.c
+extern const ht_backend twolevel_backend;  // mutex_parallel_mod.c
+extern const ht_backend lockfree_backend;  // parallel_lockfree.c
+extern const ht_backend probe_backend;     // parallel_probe.c
+extern const ht_backend seqlock_backend;   // parallel_seqlock.c
+extern const ht_backend sharded_backend;   // parallel_sharded.c
+extern const ht_backend inline_backend;    // parallel_inline.c
+extern const ht_backend compact_backend;   // parallel_compact.c
+extern const ht_backend wide_backend;      // parallel_wide.c
+
+void panic(char *msg);
+
+typedef struct ht_add_arg {
+    int delta;
+    int prev;             // Value before the add, set by ht_add_step()
+} ht_add_arg;
+
+static inline bool ht_add_step(int *val, bool found, void *arg) {
+    ht_add_arg *a = arg;
+    (void) found;         // A missing key's *val is already 0
+    a->prev = *val;
+    *val += a->delta;
+    return true;
+}
+
+// Adds delta to key's value, starting from 0 if the key is missing, and
+// returns the value it had before
+static inline int ht_fetch_add(const ht_backend *b, int key, int delta) {
+    ht_add_arg a = {delta, 0};
+    b->upsert(key, ht_add_step, &a);
+    return a.prev;
+}
+
+static inline bool ht_cas_step(int *val, bool found, void *arg) {
+    const int *expected_desired = arg;
+    if (!found || *val != expected_desired[0]) return false;
+    *val = expected_desired[1];
+    return true;
+}
+
+// Sets key's value to desired if it currently is expected. Returns false,
+// changing nothing, if the key is missing or holds another value.
+static inline bool ht_compare_and_set(const ht_backend *b, int key, int expected, int desired) {
+    int expected_desired[2] = {expected, desired};
+    return b->upsert(key, ht_cas_step, expected_desired);
+}
+
+// Bytes of the malloc'd block p, asked for as size bytes, that the
+// caller can't use: glibc's chunk header and the rounding up of size
+static inline size_t ht_alloc_overhead(void *p, size_t size) {
+    return p != NULL ? malloc_usable_size(p) + sizeof(size_t) - size : 0;
+}
+
+// Counts one chain of len entries, or one key len slots from home
+static inline void ht_count_chain(ht_mem_stats *st, long len) {
+    st->chains[len < HT_CHAIN_HIST ? len : HT_CHAIN_HIST - 1]++;
+}
+
+// Key hash shared by every variant. Each operation hashes its key once
+// and takes both the lock stripe and the bucket from that one value by
+// masking with a power of two, so no hot path divides, neighbouring keys
+// spread over the whole table and negative keys index like any other.
+// The default is the murmur3 32-bit finalizer; make HASH=identity builds
+// with the raw key instead, for comparison.
+#ifdef HT_HASH_IDENTITY
+#define HT_HASH_NAME "identity"  // Recorded in snapshots, which depend on it
+
+static inline unsigned ht_hash(int key) {
+    return (unsigned) key;
+}
+#else
+#define HT_HASH_NAME "murmur3"
+
+static inline unsigned ht_hash(int key) {
+    unsigned h = (unsigned) key;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+#endif
+
+// For batches on striped tables: sets stripe[i] to the stripe of hash[i],
+// out of num_stripes (a power of two, masking the low bits as every
+// table does), and fills order[] with the positions 0..n-1 grouped by
+// stripe, so a batch takes each stripe's lock once. Insertion sort, as
+// batches are small.
+static inline void ht_group_batch(const unsigned *hash, int n, int num_stripes, int *stripe,
+                                  int *order) {
+    int i, j;
+    for (i = 0; i < n; i++) {
+        stripe[i] = hash[i] & (num_stripes - 1);
+        for (j = i; j > 0 && stripe[order[j - 1]] > stripe[i]; j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+}
+
+// CPU placement, affinity.c
+int cpu_node(int cpu);
+void plan_cpus(const char *policy, int n, int *cpus);
+void pin_self(int cpu);
+
+// Linear-probe kernel for open-addressing tables, ht_simd.c. kv holds
+// capacity (key, value) int pairs, capacity a power of two. Returns the
+// first slot at or after start, wrapping around, whose key is key or
+// empty. Set to the widest SIMD version the CPU supports at startup;
+// ht_probe_kernel names it.
+extern long (*ht_probe)(const int *kv, long capacity, long start, int key, int empty);
+extern const char *ht_probe_kernel;
+
+// Pipelined client API over any backend, ht_async.c. Callers queue gets
+// and puts on their CPU's queue and get a handle back at once; drainer
+// threads apply the queued requests in batches, so callers that hit the
+// same stripe share one lock acquisition. A handle is caller-owned and
+// must stay alive until ht_async_wait() returns for it; a put may pass
+// NULL if it is never waited for.
+typedef struct ht_future {
+    int val;              // Value a get found
+    bool found;           // Whether a get found the key, true for a put
+    int done;             // Set by the drainer once val and found are final
+} ht_future;
+
+void ht_async_init(const ht_backend *b, int num_queues, const int *cpus);
+void ht_async_get(int key, ht_future *f);
+void ht_async_put(int key, int val, ht_future *f);
+bool ht_async_wait(ht_future *f);  // Returns the handle's found
+void ht_async_destroy(void);
+
+// Lock instrumentation, built in with -DHT_STATS (make STATS=1). Backends
+// take their locks through the ht_* wrappers below, which count into the
+// calling thread's ht_stats; without HT_STATS they are the plain pthread
+// calls and STAT_ADD expands to nothing.
+#ifdef HT_STATS
+typedef struct ht_stats {
+    unsigned long lock_acquires;    // Lock calls
+    unsigned long lock_contended;   // Calls whose first trylock failed
+    unsigned long spin_iterations;  // Busy-wait rounds and failed CAS retries
+    unsigned long tx_commits;       // Critical sections elided by a transaction
+    unsigned long tx_aborts;        // Transactions that aborted
+} ht_stats;
+
+extern __thread ht_stats thread_stats;  // Defined by the harness
+
+#define STAT_ADD(field, n) (thread_stats.field += (n))
+
+static inline void ht_mutex_lock(pthread_mutex_t *m) {
+    thread_stats.lock_acquires++;
+    if (pthread_mutex_trylock(m) != 0) {
+        thread_stats.lock_contended++;
+        pthread_mutex_lock(m);
+    }
+}
+
+static inline void ht_spin_lock(pthread_spinlock_t *s) {
+    thread_stats.lock_acquires++;
+    if (pthread_spin_trylock(s) == 0) return;
+    thread_stats.lock_contended++;
+    // The lock word's encoding is up to the libc, so retry via trylock
+    do {
+        thread_stats.spin_iterations++;
+    } while (pthread_spin_trylock(s) != 0);
+}
+
+static inline void ht_rdlock(pthread_rwlock_t *l) {
+    thread_stats.lock_acquires++;
+    if (pthread_rwlock_tryrdlock(l) != 0) {
+        thread_stats.lock_contended++;
+        pthread_rwlock_rdlock(l);
+    }
+}
+
+static inline void ht_wrlock(pthread_rwlock_t *l) {
+    thread_stats.lock_acquires++;
+    if (pthread_rwlock_trywrlock(l) != 0) {
+        thread_stats.lock_contended++;
+        pthread_rwlock_wrlock(l);
+    }
+}
+#else
+#define STAT_ADD(field, n) ((void) 0)
+#define ht_mutex_lock pthread_mutex_lock
+#define ht_spin_lock pthread_spin_lock
+#define ht_rdlock pthread_rwlock_rdlock
+#define ht_wrlock pthread_rwlock_wrlock
+#endif
+
+// Stripe locks with a kind picked at init, ht_lock.c. HT_LOCK_PTHREAD is
+// a plain mutex; HT_LOCK_MCS queues waiters so each spins on its own
+// node; HT_LOCK_TICKET is a FIFO ticket lock with proportional backoff;
+// HT_LOCK_ADAPTIVE spins briefly and then sleeps on a futex;
+// HT_LOCK_ELIDED runs the critical section as a hardware transaction that
+// only reads the lock word, and takes the HT_LOCK_ADAPTIVE lock when
+// transactions keep aborting or the CPU has none.
+enum { HT_LOCK_PTHREAD, HT_LOCK_MCS, HT_LOCK_TICKET, HT_LOCK_ADAPTIVE, HT_LOCK_ELIDED };
+
+typedef struct mcs_node {
+    struct mcs_node *next;
+    int locked;           // Cleared by the predecessor to hand the lock over
+} __attribute__((aligned(CACHE_LINE))) mcs_node;
+
+typedef struct ht_lock {
+    int kind;
+    union {
+        pthread_mutex_t mutex;
+        struct {
+            mcs_node *tail;   // Last waiter, NULL when free
+            mcs_node *holder; // Node of the thread holding the lock
+        } mcs;
+        struct {
+            unsigned next;    // Next ticket to hand out
+            unsigned serving; // Ticket allowed in
+        } ticket;
+        int futex;        // 0 free, 1 held, 2 held with sleepers; also elided
+    };
+} __attribute__((aligned(CACHE_LINE))) ht_lock;
+
+void ht_lock_init(ht_lock *l, int kind);
+void ht_lock_destroy(ht_lock *l);
+void ht_lock_acquire(ht_lock *l);
+void ht_lock_release(ht_lock *l);
+
+// The same with a queue node from the caller, who must not use it for
+// another lock until ht_lock_release_node(), for holding many locks at
+// once. HT_LOCK_MCS uses the node, so one thread can hold more MCS locks
+// than its own pool has nodes; HT_LOCK_ELIDED takes the lock without a
+// transaction, since nested ones would only abort.
+void ht_lock_acquire_node(ht_lock *l, mcs_node *node);
+void ht_lock_release_node(ht_lock *l);
+
+// The HT_LOCK_ADAPTIVE lock on a bare int, for structures with no room
+// for a whole ht_lock. *word starts at 0.
+void ht_futex_lock(int *word);
+void ht_futex_unlock(int *word);
+
+#endif
@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "hashtable.h"
+
+#define QUEUE_SIZE 1024   // Requests per queue, a power of two
+#define DRAIN_BATCH 64    // Requests a drainer takes off its queue at once
+
+// Pipelined client API. Every CPU's callers share one bounded queue, so a
+// submission costs one fetch-and-add on the queue tail rather than a
+// trip through the table's locks. A drainer thread per queue takes up to
+// DRAIN_BATCH ready requests at a time and hands each run of consecutive
+// gets or puts to the backend's retrieve_batch() or insert_batch(), which
+// sort their keys by stripe. Requests from many callers that land on one
+// stripe therefore share a single lock acquisition, and the drainer
+// keeps the stripe's lines warm in its cache.
+//
+// Runs are applied in queue order. Requests a caller still has in
+// flight are unordered across queues, since the caller may move between
+// CPUs, so a caller that needs a put applied before a later get waits
+// for the put first.
+enum { ASYNC_GET, ASYNC_PUT };
+
+// A queue slot. seq is the slot's turn: a producer whose ticket is pos
+// may fill it once seq == pos, and publishes it by setting seq to pos + 1.
+// The drainer frees it for the next lap by setting seq to
+// pos + QUEUE_SIZE.
+typedef struct async_req {
+    unsigned long seq;
+    int op;
+    int key;
+    int val;
+    ht_future *f;
+} async_req;
+
+typedef struct async_queue {
+    unsigned long tail __attribute__((aligned(CACHE_LINE)));  // Next ticket handed out
+    unsigned long head __attribute__((aligned(CACHE_LINE)));  // Next slot drained, drainer only
+    async_req slots[QUEUE_SIZE];
+    pthread_t drainer;
+} __attribute__((aligned(CACHE_LINE))) async_queue;
+
+static const ht_backend *async_backend;
+static async_queue *queues;
+static int num_queues;
+static int stop;          // Tells the drainers to exit once their queue is empty
+static const int *drainer_cpus;  // CPU of each drainer, NULL when unpinned
+
+// Applies the n ready requests starting at seq head of q, one batch call
+// per run of the same operation, and completes their handles
+static void apply(async_queue *q, unsigned long head, int n) {
+    int batch_keys[DRAIN_BATCH], vals[DRAIN_BATCH];
+    bool found[DRAIN_BATCH];
+    int i = 0, k;
+
+    while (i < n) {
+        int op = q->slots[(head + i) & (QUEUE_SIZE - 1)].op;
+        int count = 0;
+        for (; i + count < n; count++) {
+            async_req *req = &q->slots[(head + i + count) & (QUEUE_SIZE - 1)];
+            if (req->op != op) break;
+            batch_keys[count] = req->key;
+            vals[count] = req->val;
+        }
+        if (op == ASYNC_GET) {
+            async_backend->retrieve_batch(batch_keys, vals, found, count);
+        } else {
+            async_backend->insert_batch(batch_keys, vals, count);
+            // Backends that post or buffer inserts publish them here, so
+            // a put is visible by the time its handle is done
+            if (async_backend->flush != NULL) async_backend->flush();
+        }
+        for (k = 0; k < count; k++) {
+            ht_future *f = q->slots[(head + i + k) & (QUEUE_SIZE - 1)].f;
+            if (f == NULL) continue;
+            if (op == ASYNC_GET) {
+                f->val = vals[k];
+                f->found = found[k];
+            } else {
+                f->found = true;
+            }
+            __atomic_store_n(&f->done, 1, __ATOMIC_RELEASE);
+        }
+        i += count;
+    }
+}
+
+// Drains one queue until ht_async_destroy() sets stop and the queue is
+// empty, yielding the CPU whenever there is nothing to do
+static void * drain_loop(void *arg) {
+    async_queue *q = (async_queue *) arg;
+    int i;
+
+    if (drainer_cpus != NULL) pin_self(drainer_cpus[q - queues]);
+
+    for (;;) {
+        unsigned long head = q->head;
+        int n = 0;
+        while (n < DRAIN_BATCH &&
+               __atomic_load_n(&q->slots[(head + n) & (QUEUE_SIZE - 1)].seq,
+                               __ATOMIC_ACQUIRE) == head + n + 1) {
+            n++;
+        }
+        if (n == 0) {
+            if (__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) break;
+            sched_yield();
+            continue;
+        }
+        apply(q, head, n);
+        for (i = 0; i < n; i++) {
+            __atomic_store_n(&q->slots[(head + i) & (QUEUE_SIZE - 1)].seq,
+                             head + i + QUEUE_SIZE, __ATOMIC_RELEASE);
+        }
+        q->head = head + n;
+    }
+    return NULL;
+}
+
+// Queues a request on the calling CPU's queue, waiting for the drainer to
+// free the slot if the queue is a full lap ahead
+static void submit(int op, int key, int val, ht_future *f) {
+    int cpu = sched_getcpu();
+    async_queue *q = &queues[(cpu < 0 ? 0 : cpu) % num_queues];
+    if (f != NULL) f->done = 0;
+    unsigned long pos = __atomic_fetch_add(&q->tail, 1, __ATOMIC_RELAXED);
+    async_req *req = &q->slots[pos & (QUEUE_SIZE - 1)];
+    while (__atomic_load_n(&req->seq, __ATOMIC_ACQUIRE) != pos) {
+        STAT_ADD(spin_iterations, 1);
+        sched_yield();
+    }
+    req->op = op;
+    req->key = key;
+    req->val = val;
+    req->f = f;
+    __atomic_store_n(&req->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+void ht_async_get(int key, ht_future *f) {
+    submit(ASYNC_GET, key, 0, f);
+}
+
+void ht_async_put(int key, int val, ht_future *f) {
+    submit(ASYNC_PUT, key, val, f);
+}
+
+bool ht_async_wait(ht_future *f) {
+    while (!__atomic_load_n(&f->done, __ATOMIC_ACQUIRE)) {
+        STAT_ADD(spin_iterations, 1);
+        sched_yield();
+    }
+    return f->found;
+}
+
+// Starts n queues and their drainers over the initialized backend b,
+// drainer i pinned to cpus[i] if cpus is set
+void ht_async_init(const ht_backend *b, int n, const int *cpus) {
+    int i;
+    unsigned long k;
+    async_backend = b;
+    num_queues = n;
+    drainer_cpus = cpus;
+    stop = 0;
+
+    queues = aligned_alloc(CACHE_LINE, sizeof(async_queue) * num_queues);
+    if (!queues) {
+        panic("out of memory allocating async queues");
+    }
+    memset(queues, 0, sizeof(async_queue) * num_queues);
+    for (i = 0; i < num_queues; i++) {
+        for (k = 0; k < QUEUE_SIZE; k++) {
+            queues[i].slots[k].seq = k;
+        }
+        if (pthread_create(&queues[i].drainer, NULL, drain_loop, &queues[i]) != 0) {
+            panic("cannot start async drainer");
+        }
+    }
+}
+
+// Applies everything still queued, then stops the drainers. No request
+// may be submitted once this has started.
+void ht_async_destroy(void) {
+    int i;
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < num_queues; i++) {
+        pthread_join(queues[i].drainer, NULL);
+    }
+    free(queues);
+}
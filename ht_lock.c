@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_RTM 1
+#endif
+
+#include "hashtable.h"
+
+#define MAX_HELD_LOCKS 16  // MCS locks one thread may hold at once from its pool
+#define SPIN_LIMIT 128    // Busy-wait rounds before yielding or parking
+#define TICKET_BACKOFF 16 // Pause rounds per waiter ahead in the ticket queue
+#define ELIDE_RETRIES 3   // Transactions tried before taking an elided lock
+#define ELIDE_LOCKED 0xff // Abort code for finding the elided lock held
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+// Busy-waiting is hopeless once the thread we wait for is descheduled,
+// which with more threads than cores is the common case. After
+// SPIN_LIMIT rounds this gives the CPU away.
+static void spin_wait(unsigned *spins) {
+    STAT_ADD(spin_iterations, 1);
+    if (++*spins < SPIN_LIMIT) {
+        cpu_relax();
+    } else {
+        *spins = 0;
+        sched_yield();
+    }
+}
+
+// MCS queue nodes come from a per-thread pool; a thread needs one per
+// lock it holds. Holding every stripe at once, as lock_all_buckets()
+// does, would outgrow any fixed pool, so that path brings its own nodes
+// through ht_lock_acquire_node().
+static __thread mcs_node mcs_pool[MAX_HELD_LOCKS];
+static __thread mcs_node *mcs_free;
+static __thread int mcs_pool_used;
+
+static mcs_node * get_node() {
+    mcs_node *n = mcs_free;
+    if (n != NULL) {
+        mcs_free = n->next;
+        return n;
+    }
+    if (mcs_pool_used == MAX_HELD_LOCKS) panic("Too many MCS locks held!");
+    return &mcs_pool[mcs_pool_used++];
+}
+
+static void put_node(mcs_node *n) {
+    n->next = mcs_free;
+    mcs_free = n;
+}
+
+// Each waiter spins on its own node, so a release touches only the next
+// waiter's cache line and the queue hands the lock over in FIFO order
+static void mcs_acquire(ht_lock *l, mcs_node *me) {
+    mcs_node *pred;
+    unsigned spins = 0;
+    me->next = NULL;
+    me->locked = 1;
+    pred = __atomic_exchange_n(&l->mcs.tail, me, __ATOMIC_ACQ_REL);
+    if (pred != NULL) {
+        STAT_ADD(lock_contended, 1);
+        __atomic_store_n(&pred->next, me, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&me->locked, __ATOMIC_ACQUIRE)) spin_wait(&spins);
+    }
+    l->mcs.holder = me;
+}
+
+// Returns the holder's node, free to reuse once this returns
+static mcs_node * mcs_release(ht_lock *l) {
+    mcs_node *me = l->mcs.holder;
+    mcs_node *next = __atomic_load_n(&me->next, __ATOMIC_ACQUIRE);
+    unsigned spins = 0;
+    if (next == NULL) {
+        mcs_node *expected = me;
+        if (__atomic_compare_exchange_n(&l->mcs.tail, &expected, NULL, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return me;
+        }
+        // A waiter swapped itself in but hasn't linked behind us yet
+        while ((next = __atomic_load_n(&me->next, __ATOMIC_ACQUIRE)) == NULL) spin_wait(&spins);
+    }
+    __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+    return me;
+}
+
+// FIFO ticket lock; waiters back off in proportion to their place in line
+// so they poll the shared serving word less often
+static void ticket_acquire(ht_lock *l) {
+    unsigned me = __atomic_fetch_add(&l->ticket.next, 1, __ATOMIC_RELAXED);
+    unsigned serving = __atomic_load_n(&l->ticket.serving, __ATOMIC_ACQUIRE);
+    unsigned i, spins = 0;
+    if (serving == me) return;
+    STAT_ADD(lock_contended, 1);
+    do {
+        for (i = 0; i < (me - serving) * TICKET_BACKOFF; i++) cpu_relax();
+        spin_wait(&spins);
+    } while ((serving = __atomic_load_n(&l->ticket.serving, __ATOMIC_ACQUIRE)) != me);
+}
+
+static void ticket_release(ht_lock *l) {
+    __atomic_store_n(&l->ticket.serving, l->ticket.serving + 1, __ATOMIC_RELEASE);
+}
+
+static void futex_wait(int *addr, int val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(int *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// Spin-then-park lock after Drepper's "Futexes Are Tricky": 0 is free, 1
+// held, 2 held with sleepers. Short critical sections are waited out by
+// spinning; only a holder that stays longer than SPIN_LIMIT rounds sends
+// waiters into the kernel.
+void ht_futex_lock(int *word) {
+    int c = 0, i;
+    STAT_ADD(lock_acquires, 1);
+    if (__atomic_compare_exchange_n(word, &c, 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    STAT_ADD(lock_contended, 1);
+    for (i = 0; i < SPIN_LIMIT; i++) {
+        STAT_ADD(spin_iterations, 1);
+        cpu_relax();
+        c = 0;
+        if (__atomic_load_n(word, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(word, &c, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+    // Mark the lock contended and sleep until a release wakes us
+    while (__atomic_exchange_n(word, 2, __ATOMIC_ACQUIRE) != 0) {
+        futex_wait(word, 2);
+    }
+}
+
+void ht_futex_unlock(int *word) {
+    if (__atomic_exchange_n(word, 0, __ATOMIC_RELEASE) == 2) {
+        futex_wake(word);
+    }
+}
+
+#ifdef HAVE_RTM
+static int have_rtm;      // CPU supports RTM transactions
+
+// RTM is CPUID leaf 7, EBX bit 11. Microcode updates that disable TSX
+// clear the bit, so this also catches CPUs where it was turned off.
+__attribute__((constructor))
+static void detect_rtm() {
+    unsigned a, b, c, d;
+    if (__get_cpuid_count(7, 0, &a, &b, &c, &d)) have_rtm = (b >> 11) & 1;
+}
+
+// Lock elision: the critical section runs as a transaction that only
+// reads the lock word, so threads in different buckets never write a
+// shared line and commit in parallel. Reading the word puts it in the
+// transaction's read set, so a thread that really takes the lock aborts
+// every transaction running under it. Held locks and transient aborts
+// are retried; aborts the hardware marks as hopeless, such as a system
+// call inside the section, go straight to the lock. Nested acquires
+// nest the transaction, and an abort always unwinds to the outermost, so
+// paths that hold many locks at once take them through
+// ht_lock_acquire_node(), which never elides.
+//
+// The machines this has been run on so far have no RTM (or have it
+// disabled), so only the fallback to ht_futex_lock() has actually
+// executed; the transactional path is compiled but unmeasured.
+__attribute__((target("rtm")))
+static void elided_acquire(ht_lock *l) {
+    int tries;
+    unsigned spins = 0;
+    if (have_rtm) {
+        for (tries = 0; tries < ELIDE_RETRIES; tries++) {
+            unsigned status = _xbegin();
+            if (status == _XBEGIN_STARTED) {
+                if (__atomic_load_n(&l->futex, __ATOMIC_RELAXED) == 0) return;
+                _xabort(ELIDE_LOCKED);
+            }
+            STAT_ADD(tx_aborts, 1);
+            if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == ELIDE_LOCKED) {
+                // Let the holder finish instead of aborting on it again
+                while (__atomic_load_n(&l->futex, __ATOMIC_RELAXED) != 0) spin_wait(&spins);
+            } else if (!(status & _XABORT_RETRY)) {
+                break;
+            }
+        }
+    }
+    ht_futex_lock(&l->futex);
+}
+
+// Taking the lock for real never happens inside a transaction, so a
+// running transaction means this lock was elided
+__attribute__((target("rtm")))
+static void elided_release(ht_lock *l) {
+    if (have_rtm && _xtest()) {
+        _xend();
+        STAT_ADD(tx_commits, 1);
+        return;
+    }
+    ht_futex_unlock(&l->futex);
+}
+#else
+// No transactional memory on this architecture, so the elided kind is
+// the adaptive lock
+static void elided_acquire(ht_lock *l) {
+    ht_futex_lock(&l->futex);
+}
+
+static void elided_release(ht_lock *l) {
+    ht_futex_unlock(&l->futex);
+}
+#endif
+
+void ht_lock_init(ht_lock *l, int kind) {
+    l->kind = kind;
+    switch (kind) {
+    case HT_LOCK_PTHREAD: pthread_mutex_init(&l->mutex, NULL); break;
+    case HT_LOCK_MCS: l->mcs.tail = NULL; break;
+    case HT_LOCK_TICKET: l->ticket.next = l->ticket.serving = 0; break;
+    case HT_LOCK_ADAPTIVE: l->futex = 0; break;
+    case HT_LOCK_ELIDED: l->futex = 0; break;
+    default: panic("unknown lock kind");
+    }
+}
+
+void ht_lock_destroy(ht_lock *l) {
+    if (l->kind == HT_LOCK_PTHREAD) pthread_mutex_destroy(&l->mutex);
+}
+
+void ht_lock_acquire(ht_lock *l) {
+    switch (l->kind) {
+    // These do their own counting
+    case HT_LOCK_PTHREAD: ht_mutex_lock(&l->mutex); return;
+    case HT_LOCK_ADAPTIVE: ht_futex_lock(&l->futex); return;
+    case HT_LOCK_ELIDED: elided_acquire(l); return;
+    }
+    STAT_ADD(lock_acquires, 1);
+    switch (l->kind) {
+    case HT_LOCK_MCS: mcs_acquire(l, get_node()); break;
+    case HT_LOCK_TICKET: ticket_acquire(l); break;
+    }
+}
+
+void ht_lock_release(ht_lock *l) {
+    switch (l->kind) {
+    case HT_LOCK_PTHREAD: pthread_mutex_unlock(&l->mutex); break;
+    case HT_LOCK_MCS: put_node(mcs_release(l)); break;
+    case HT_LOCK_TICKET: ticket_release(l); break;
+    case HT_LOCK_ADAPTIVE: ht_futex_unlock(&l->futex); break;
+    case HT_LOCK_ELIDED: elided_release(l); break;
+    }
+}
+
+// Taking every stripe under HT_LOCK_ELIDED would nest one transaction per
+// stripe, well past what the hardware tracks, and each level would burn
+// its ELIDE_RETRIES before giving up, and a resize frees the old buckets
+// while holding them. So the elided kind takes its lock word for real
+// here, which still aborts any transaction eliding the same lock.
+void ht_lock_acquire_node(ht_lock *l, mcs_node *node) {
+    switch (l->kind) {
+    case HT_LOCK_MCS:
+        STAT_ADD(lock_acquires, 1);
+        mcs_acquire(l, node);
+        return;
+    case HT_LOCK_ELIDED: ht_futex_lock(&l->futex); return;
+    }
+    ht_lock_acquire(l);
+}
+
+void ht_lock_release_node(ht_lock *l) {
+    switch (l->kind) {
+    case HT_LOCK_MCS: mcs_release(l); return;
+    case HT_LOCK_ELIDED: ht_futex_unlock(&l->futex); return;
+    }
+    ht_lock_release(l);
+}
@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "hashtable.h"
+
+// Linear-probe kernels for tables of (key, value) int pairs. Each vector
+// kernel compares a whole run of keys against both the probe key and the
+// empty marker in one go and takes the first hit from a movemask, so a
+// long probe sequence costs one compare per 2-8 slots instead of two per
+// slot. Vectors never cross the end of the table; the last few slots
+// before the wrap are finished by the scalar loop.
+
+static long probe_scalar(const int *kv, long capacity, long start, int key, int empty) {
+    long mask = capacity - 1;
+    long i = start;
+    while (kv[2 * i] != key && kv[2 * i] != empty) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 2 slots per compare. SSE2 is part of x86-64 but not of every i386.
+__attribute__((target("sse2")))
+static long probe_sse2(const int *kv, long capacity, long start, int key, int empty) {
+    __m128i k = _mm_set1_epi32(key), e = _mm_set1_epi32(empty);
+    long i = start;
+    for (;;) {
+        for (; i + 2 <= capacity; i += 2) {
+            __m128i v = _mm_loadu_si128((const __m128i *) &kv[2 * i]);
+            __m128i hit = _mm_or_si128(_mm_cmpeq_epi32(v, k), _mm_cmpeq_epi32(v, e));
+            int bits = _mm_movemask_ps(_mm_castsi128_ps(hit)) & 0x5;  // Key lanes only
+            if (bits) return i + __builtin_ctz(bits) / 2;
+        }
+        for (; i < capacity; i++) {
+            if (kv[2 * i] == key || kv[2 * i] == empty) return i;
+        }
+        i = 0;
+    }
+}
+
+// 4 slots per compare
+__attribute__((target("avx2")))
+static long probe_avx2(const int *kv, long capacity, long start, int key, int empty) {
+    __m256i k = _mm256_set1_epi32(key), e = _mm256_set1_epi32(empty);
+    long i = start;
+    for (;;) {
+        for (; i + 4 <= capacity; i += 4) {
+            __m256i v = _mm256_loadu_si256((const __m256i *) &kv[2 * i]);
+            __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi32(v, k), _mm256_cmpeq_epi32(v, e));
+            int bits = _mm256_movemask_ps(_mm256_castsi256_ps(hit)) & 0x55;
+            if (bits) return i + __builtin_ctz(bits) / 2;
+        }
+        for (; i < capacity; i++) {
+            if (kv[2 * i] == key || kv[2 * i] == empty) return i;
+        }
+        i = 0;
+    }
+}
+
+// 8 slots per compare; the compares write mask registers directly, and
+// the key lanes are selected by the mask the second compare runs under
+__attribute__((target("avx512f")))
+static long probe_avx512(const int *kv, long capacity, long start, int key, int empty) {
+    __m512i k = _mm512_set1_epi32(key), e = _mm512_set1_epi32(empty);
+    long i = start;
+    for (;;) {
+        for (; i + 8 <= capacity; i += 8) {
+            __m512i v = _mm512_loadu_si512(&kv[2 * i]);
+            __mmask16 bits = _mm512_mask_cmpeq_epi32_mask(0x5555, v, k) |
+                             _mm512_mask_cmpeq_epi32_mask(0x5555, v, e);
+            if (bits) return i + __builtin_ctz(bits) / 2;
+        }
+        for (; i < capacity; i++) {
+            if (kv[2 * i] == key || kv[2 * i] == empty) return i;
+        }
+        i = 0;
+    }
+}
+#elif defined(__aarch64__)
+// 4 slots per compare. vld2q splits keys from values, and narrowing the
+// 32-bit compare lanes to 16 bits leaves a 64-bit mask to count zeros in.
+static long probe_neon(const int *kv, long capacity, long start, int key, int empty) {
+    int32x4_t k = vdupq_n_s32(key), e = vdupq_n_s32(empty);
+    long i = start;
+    for (;;) {
+        for (; i + 4 <= capacity; i += 4) {
+            int32x4x2_t v = vld2q_s32(&kv[2 * i]);
+            uint32x4_t hit = vorrq_u32(vceqq_s32(v.val[0], k), vceqq_s32(v.val[0], e));
+            uint64_t bits = vget_lane_u64(vreinterpret_u64_u16(vmovn_u32(hit)), 0);
+            if (bits) return i + __builtin_ctzll(bits) / 16;
+        }
+        for (; i < capacity; i++) {
+            if (kv[2 * i] == key || kv[2 * i] == empty) return i;
+        }
+        i = 0;
+    }
+}
+#endif
+
+long (*ht_probe)(const int *kv, long capacity, long start, int key, int empty) = probe_scalar;
+const char *ht_probe_kernel = "scalar";
+
+static void use_kernel(const char *name,
+                       long (*kernel)(const int *, long, long, int, int)) {
+    ht_probe = kernel;
+    ht_probe_kernel = name;
+}
+
+// Picks the widest kernel the running CPU supports before main() starts,
+// so the pointer never changes while threads use it. HT_PROBE_KERNEL
+// names a narrower one to compare against, e.g. HT_PROBE_KERNEL=scalar.
+__attribute__((constructor))
+static void pick_kernel() {
+    const char *want = getenv("HT_PROBE_KERNEL");
+    if (want != NULL && strcmp(want, "scalar") == 0) return;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) use_kernel("sse2", probe_sse2);
+    if (want != NULL && strcmp(want, "sse2") == 0) return;
+    if (__builtin_cpu_supports("avx2")) use_kernel("avx2", probe_avx2);
+    if (want != NULL && strcmp(want, "avx2") == 0) return;
+    if (__builtin_cpu_supports("avx512f")) use_kernel("avx512", probe_avx512);
+#elif defined(__aarch64__)
+    use_kernel("neon", probe_neon);
+#endif
+}
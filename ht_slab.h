@@ -0,0 +1,202 @@
+// Per-thread slab allocator for table entries, shared by every chained
+// table.
+//
+// Entries are carved out of large per-thread slabs instead of being
+// malloc'd one by one, so inserts skip the allocator lock, chains stay
+// close together in memory and teardown frees whole slabs. Entries are
+// never freed one at a time; a table that removes keys reuses them
+// itself. Like ht_template.h this is instantiated per entry type by
+// defining the parameters and including it:
+//
+//     #define SLAB_PREFIX pool            // Names are pool_alloc, pool_free, ...
+//     #define SLAB_ENTRY bucket_entry     // Entry type, complete at this point
+//     #include "ht_slab.h"
+//
+// Optional parameters:
+//
+//     SLAB_ENTRIES        Entries carved from each slab, default 4096
+//     SLAB_NUMBERED       Number the slabs, so an entry can be named by a
+//                         32-bit ref instead of a pointer: entry i of slab
+//                         number n is ref n * SLAB_ENTRIES + i. Numbers
+//                         start at 1, so ref 0 is free to mean nil.
+//     SLAB_FREE_ENTRY(e)  Run on every entry handed out before its slab
+//                         is freed
+//
+// Generated, for prefix P:
+//
+//     void         P_init(void)              Empty pool; call before the first alloc
+//     SLAB_ENTRY * P_alloc(void)             An entry, NULL if no memory is left
+//     uint32_t     P_alloc_ref(void)         SLAB_NUMBERED: an entry's ref, 0 if no
+//                                            memory or slab number is left
+//     SLAB_ENTRY * P_at(uint32_t ref)        SLAB_NUMBERED: the entry ref names
+//     void         P_stats(ht_mem_stats *out, long live)
+//     void         P_free(void)              Frees every entry at once
+//
+// All state is static to the including file. Each thread's current slab
+// is kept with the generation of the pool it came from, and P_init starts
+// a new generation, so a thread that outlives one table never allocates
+// from the freed slab of the table before. The parameters are #undef'd
+// at the end.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hashtable.h"
+
+#if !defined(SLAB_PREFIX) || !defined(SLAB_ENTRY)
+#error "define SLAB_PREFIX and SLAB_ENTRY before including ht_slab.h"
+#endif
+
+#ifndef SLAB_ENTRIES
+#define SLAB_ENTRIES 4096
+#endif
+
+#define SLAB_CAT_(a, b) a##b
+#define SLAB_CAT(a, b) SLAB_CAT_(a, b)
+#define SLAB_(name) SLAB_CAT(SLAB_PREFIX, SLAB_CAT(_, name))
+
+#ifdef SLAB_NUMBERED
+#define SLAB_MAX_SLABS ((1UL << 32) / SLAB_ENTRIES)  // Slab numbers a ref can name
+#endif
+
+typedef struct SLAB_(slab) {
+    struct SLAB_(slab) *next;  // Every slab is on the pool's list for the bulk free
+    int used;                  // Entries handed out so far
+#ifdef SLAB_NUMBERED
+    uint32_t number;           // Index in the pool's arena
+#endif
+    SLAB_ENTRY entries[SLAB_ENTRIES];
+} SLAB_(slab);
+
+static struct {
+    SLAB_(slab) *all;
+    unsigned generation;       // Bumped by every init, never reset
+#ifdef SLAB_NUMBERED
+    SLAB_(slab) **arena;       // Slab of each slab number, SLAB_MAX_SLABS long
+    uint32_t num_slabs;        // Next slab number handed out
+#endif
+} SLAB_(pool);
+
+// Slab the calling thread allocates from, valid only while its
+// generation is the pool's
+static __thread struct {
+    SLAB_(slab) *slab;
+    unsigned generation;
+} SLAB_(current);
+
+static inline void SLAB_(init)(void) {
+    SLAB_(pool).all = NULL;
+    SLAB_(pool).generation++;
+#ifdef SLAB_NUMBERED
+    // A pointer of address space per slab number; a large calloc is
+    // fresh zero pages, so only the slab numbers in use take memory
+    SLAB_(pool).arena = calloc(SLAB_MAX_SLABS, sizeof(SLAB_(slab) *));
+    SLAB_(pool).num_slabs = 1;
+    if (!SLAB_(pool).arena) {
+        panic("out of memory allocating entry arena");
+    }
+#endif
+}
+
+// Starts a new slab for the calling thread. Returns NULL if no memory,
+// or under SLAB_NUMBERED no slab number, is left.
+static inline SLAB_(slab) * SLAB_(grow)(void) {
+    SLAB_(slab) *s = (SLAB_(slab) *) malloc(sizeof(SLAB_(slab)));
+    if (!s) return NULL;
+    s->used = 0;
+#ifdef SLAB_NUMBERED
+    // The arena slot is written before any entry of the slab is linked,
+    // so whatever publishes the entry publishes the slot
+    s->number = __atomic_fetch_add(&SLAB_(pool).num_slabs, 1, __ATOMIC_RELAXED);
+    if (s->number >= SLAB_MAX_SLABS) {
+        free(s);
+        return NULL;
+    }
+    SLAB_(pool).arena[s->number] = s;
+#endif
+    s->next = __atomic_load_n(&SLAB_(pool).all, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&SLAB_(pool).all, &s->next, s, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    SLAB_(current).slab = s;
+    SLAB_(current).generation = SLAB_(pool).generation;
+    return s;
+}
+
+// The calling thread's slab, NULL if it has none in this pool yet. A slab
+// left from an earlier pool is already freed, so only its generation is
+// looked at.
+static inline SLAB_(slab) * SLAB_(mine)(void) {
+    return SLAB_(current).generation == SLAB_(pool).generation ? SLAB_(current).slab : NULL;
+}
+
+// Hands out an entry from the calling thread's slab, starting a new slab
+// when it runs out
+static inline SLAB_ENTRY * SLAB_(alloc)(void) {
+    SLAB_(slab) *s = SLAB_(mine)();
+    if (s == NULL || s->used == SLAB_ENTRIES) {
+        if ((s = SLAB_(grow)()) == NULL) return NULL;
+    }
+    return &s->entries[s->used++];
+}
+
+#ifdef SLAB_NUMBERED
+static inline uint32_t SLAB_(alloc_ref)(void) {
+    SLAB_(slab) *s = SLAB_(mine)();
+    if (s == NULL || s->used == SLAB_ENTRIES) {
+        if ((s = SLAB_(grow)()) == NULL) return 0;
+    }
+    return s->number * SLAB_ENTRIES + s->used++;
+}
+
+// The entry ref names. This costs one load from the arena, which stays
+// cached: it is a pointer per SLAB_ENTRIES entries.
+static inline SLAB_ENTRY * SLAB_(at)(uint32_t ref) {
+    return &SLAB_(pool).arena[ref / SLAB_ENTRIES]->entries[ref % SLAB_ENTRIES];
+}
+#endif
+
+// Memory footprint of the pool, see ht_mem_stats. Adds the slabs' headers,
+// free space and allocator overhead to out->overhead_bytes, along with
+// every entry handed out beyond the live ones still holding a key. Under
+// SLAB_NUMBERED the arena's used part counts as index.
+static inline void SLAB_(stats)(ht_mem_stats *out, long live) {
+    SLAB_(slab) *s;
+    long handed = 0;
+    for (s = SLAB_(pool).all; s != NULL; s = s->next) {
+        out->overhead_bytes += ht_alloc_overhead(s, sizeof(*s)) +
+                               offsetof(SLAB_(slab), entries) +
+                               sizeof(SLAB_ENTRY) * (SLAB_ENTRIES - s->used);
+        handed += s->used;
+    }
+    out->overhead_bytes += sizeof(SLAB_ENTRY) * (handed - live);
+#ifdef SLAB_NUMBERED
+    out->index_bytes += sizeof(SLAB_(slab) *) * SLAB_(pool).num_slabs;
+#endif
+}
+
+static inline void SLAB_(free)(void) {
+    while (SLAB_(pool).all != NULL) {
+        SLAB_(slab) *next = SLAB_(pool).all->next;
+#ifdef SLAB_FREE_ENTRY
+        int i;
+        for (i = 0; i < SLAB_(pool).all->used; i++) {
+            SLAB_FREE_ENTRY(&SLAB_(pool).all->entries[i]);
+        }
+#endif
+        free(SLAB_(pool).all);
+        SLAB_(pool).all = next;
+    }
+#ifdef SLAB_NUMBERED
+    free(SLAB_(pool).arena);
+    SLAB_(pool).arena = NULL;
+#endif
+}
+
+#undef SLAB_
+#undef SLAB_PREFIX
+#undef SLAB_ENTRY
+#undef SLAB_ENTRIES
+#undef SLAB_NUMBERED
+#undef SLAB_FREE_ENTRY
+#undef SLAB_MAX_SLABS
@@ -0,0 +1,937 @@
+// Generic striped chained hash table, specialized at compile time.
+//
+// Every lock-based variant used to be its own copy of the same table:
+// stripes of locks over a chained bucket array, incremental resizing,
+// slab-allocated entries (ht_slab.h) and stripe-grouped batches,
+// differing only in the lock type. This header is that table once, written against a lock
+// policy; a translation unit instantiates it by defining the parameters
+// below and including it:
+//
+//     #define HT_PREFIX tbl               // Names are tbl_init, tbl_insert, ...
+//     #define HT_POLICY HT_POLICY_SPIN
+//     #include "ht_template.h"
+//
+// Parameters, all but HT_PREFIX and HT_POLICY optional:
+//
+//     HT_KEY, HT_VAL      Key and value types, default int
+//     HT_HASH(k)          unsigned hash of a key, default ht_hash(k)
+//     HT_KEY_EQ(a, b)     Key equality, default a == b
+//     HT_ENTRY_MUTEX      HT_POLICY_TWOLEVEL only: guard each value with a
+//                         mutex in its entry instead, for HT_VAL types the
+//                         __atomic builtins can't store
+//     HT_COMPACT          Link entries and bucket heads by 32-bit slab
+//                         ref instead of by pointer, see HT_(ref)
+//     HT_POLICY           HT_POLICY_MUTEX   pthread mutex stripes
+//                         HT_POLICY_SPIN    pthread spinlock stripes
+//                         HT_POLICY_RWLOCK  rwlock stripes, shared lookups
+//                         HT_POLICY_TWOLEVEL rwlock stripes; updates of
+//                                           existing keys only take the
+//                                           stripe for reading and store
+//                                           the value atomically
+//                         HT_POLICY_STRIPE  ht_lock stripes whose kind is
+//                                           picked at init, see P_init_kind
+//
+// The policy is resolved by the preprocessor, so each instantiation is
+// straight-line code around its own lock calls with nothing dispatched
+// at run time (beyond ht_lock's own switch for HT_POLICY_STRIPE). All
+// functions are static inline and all state is static to the including
+// file, so several instantiations can share one translation unit; the
+// parameters are #undef'd at the end for the next one.
+//
+// Generated, for prefix P:
+//
+//     void   P_init(const ht_config *cfg)
+//     void   P_init_kind(const ht_config *cfg, int lock_kind)  HT_POLICY_STRIPE only
+//     void   P_build(const ht_config *cfg, const HT_KEY *keys, const HT_VAL *vals, size_t n)
+//     void   P_build_kind(cfg, lock_kind, keys, vals, n)          HT_POLICY_STRIPE only
+//     void   P_insert(HT_KEY key, HT_VAL val)
+//     bool   P_retrieve_into(HT_KEY key, HT_VAL *val_out)
+//     void   P_insert_batch(const HT_KEY *keys, const HT_VAL *vals, size_t n)
+//     size_t P_retrieve_batch(const HT_KEY *keys, HT_VAL *vals_out, bool *found, size_t n)
+//     bool   P_upsert(HT_KEY key, P_update_fn fn, void *arg)
+//     void   P_mem_stats(ht_mem_stats *out)
+//     void   P_destroy(void)
+//
+// With int keys and values these match ht_backend's signatures directly.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "hashtable.h"
+
+#ifndef HT_TEMPLATE_POLICIES
+#define HT_TEMPLATE_POLICIES
+#define HT_POLICY_MUTEX 1
+#define HT_POLICY_SPIN 2
+#define HT_POLICY_RWLOCK 3
+#define HT_POLICY_TWOLEVEL 4
+#define HT_POLICY_STRIPE 5
+
+#define HT_CAT_(a, b) a##b
+#define HT_CAT(a, b) HT_CAT_(a, b)
+#endif
+
+#if !defined(HT_PREFIX) || !defined(HT_POLICY)
+#error "define HT_PREFIX and HT_POLICY before including ht_template.h"
+#endif
+
+#ifndef HT_KEY
+#define HT_KEY int
+#endif
+#ifndef HT_VAL
+#define HT_VAL int
+#endif
+#ifndef HT_HASH
+#define HT_HASH(k) ht_hash(k)
+#endif
+#ifndef HT_KEY_EQ
+#define HT_KEY_EQ(a, b) ((a) == (b))
+#endif
+
+#ifndef HT_NUM_BUCKETS
+#define HT_NUM_BUCKETS 8     // Initial buckets in hash table, a power of two
+#endif
+#ifndef HT_SLAB_ENTRIES
+#define HT_SLAB_ENTRIES 4096 // Entries carved from each slab
+#endif
+#ifndef HT_MAX_LOAD
+#define HT_MAX_LOAD 2        // Average chain length that triggers a resize
+#endif
+#ifndef HT_MIGRATE_STEP
+#define HT_MIGRATE_STEP 2    // Old buckets moved per insert/retrieve while resizing
+#endif
+#ifndef HT_BATCH_SIZE
+#define HT_BATCH_SIZE 64     // Keys per insert_batch/retrieve_batch round
+#endif
+
+#define HT_(name) HT_CAT(HT_PREFIX, HT_CAT(_, name))
+
+// Lock policy. Each defines the stripe's lock field and how to take it
+// exclusively (wr) and for a lookup (rd). HT_SHARED_READS policies let
+// lookups run side by side, so lookups can't move old buckets under their
+// lock and help a resize separately. HT_READ_UPDATES policies update
+// existing keys under a shared stripe, so values are stored and loaded
+// atomically, or under HT_ENTRY_LOCKS through a mutex in every entry.
+#if HT_POLICY == HT_POLICY_MUTEX
+#define HT_LOCK_FIELD pthread_mutex_t mutex;
+#define HT_LOCK_INIT(l) pthread_mutex_init(&(l)->mutex, NULL)
+#define HT_LOCK_DESTROY(l) pthread_mutex_destroy(&(l)->mutex)
+#define HT_WRLOCK(l) ht_mutex_lock(&(l)->mutex)
+#define HT_WRUNLOCK(l) pthread_mutex_unlock(&(l)->mutex)
+#define HT_SHARED_READS 0
+#define HT_READ_UPDATES 0
+#define HT_ENTRY_LOCKS 0
+#elif HT_POLICY == HT_POLICY_SPIN
+#define HT_LOCK_FIELD pthread_spinlock_t spinlock;
+#define HT_LOCK_INIT(l) pthread_spin_init(&(l)->spinlock, PTHREAD_PROCESS_PRIVATE)
+#define HT_LOCK_DESTROY(l) pthread_spin_destroy(&(l)->spinlock)
+#define HT_WRLOCK(l) ht_spin_lock(&(l)->spinlock)
+#define HT_WRUNLOCK(l) pthread_spin_unlock(&(l)->spinlock)
+#define HT_SHARED_READS 0
+#define HT_READ_UPDATES 0
+#define HT_ENTRY_LOCKS 0
+#elif HT_POLICY == HT_POLICY_RWLOCK || HT_POLICY == HT_POLICY_TWOLEVEL
+#define HT_LOCK_FIELD pthread_rwlock_t rwlock;
+#define HT_LOCK_INIT(l) pthread_rwlock_init(&(l)->rwlock, NULL)
+#define HT_LOCK_DESTROY(l) pthread_rwlock_destroy(&(l)->rwlock)
+#define HT_WRLOCK(l) ht_wrlock(&(l)->rwlock)
+#define HT_WRUNLOCK(l) pthread_rwlock_unlock(&(l)->rwlock)
+#define HT_RDLOCK(l) ht_rdlock(&(l)->rwlock)
+#define HT_RDUNLOCK(l) pthread_rwlock_unlock(&(l)->rwlock)
+#define HT_SHARED_READS 1
+#define HT_READ_UPDATES (HT_POLICY == HT_POLICY_TWOLEVEL)
+#if HT_READ_UPDATES && defined(HT_ENTRY_MUTEX)
+#define HT_ENTRY_LOCKS 1
+#else
+#define HT_ENTRY_LOCKS 0
+#endif
+#elif HT_POLICY == HT_POLICY_STRIPE
+#define HT_LOCK_FIELD ht_lock lock; mcs_node all_node;
+#define HT_LOCK_INIT(l) ht_lock_init(&(l)->lock, HT_(s).lock_kind)
+#define HT_LOCK_DESTROY(l) ht_lock_destroy(&(l)->lock)
+#define HT_WRLOCK(l) ht_lock_acquire(&(l)->lock)
+#define HT_WRUNLOCK(l) ht_lock_release(&(l)->lock)
+#define HT_ALL_WRLOCK(l) ht_lock_acquire_node(&(l)->lock, &(l)->all_node)
+#define HT_ALL_WRUNLOCK(l) ht_lock_release_node(&(l)->lock)
+#define HT_SHARED_READS 0
+#define HT_READ_UPDATES 0
+#define HT_ENTRY_LOCKS 0
+#else
+#error "unknown HT_POLICY"
+#endif
+#ifndef HT_ALL_WRLOCK
+#define HT_ALL_WRLOCK(l) HT_WRLOCK(l)
+#define HT_ALL_WRUNLOCK(l) HT_WRUNLOCK(l)
+#endif
+
+// Stripe m guards bucket b when b & (num_stripes - 1) == m. Stripe counts
+// and table sizes are powers of two, the table is never smaller than
+// num_stripes and both index with the low bits of the key's hash, so an
+// old bucket and the two new buckets it splits into are always guarded by
+// the same stripe.
+//
+// Each stripe counts its own entries, on its own cache line, instead of
+// all inserts bumping one shared counter.
+typedef struct HT_(stripe) {
+    HT_LOCK_FIELD
+    long migrate_cursor;  // Next old bucket this stripe moves while resizing
+    long entries;         // Entries in the buckets this stripe guards
+} __attribute__((aligned(CACHE_LINE))) HT_(stripe);
+
+// A link to an entry, as held by bucket heads and next fields. Under
+// HT_COMPACT it is a 32-bit slab ref (see SLAB_NUMBERED in ht_slab.h)
+// instead of a pointer, which takes int entries from 16 bytes to 12 and
+// halves the bucket array. Ref 0 is the nil link as NULL is for pointers.
+#ifdef HT_COMPACT
+typedef uint32_t HT_(ref);
+#else
+typedef struct HT_(entry) *HT_(ref);
+#endif
+#define HT_NIL ((HT_(ref)) 0)
+
+typedef struct HT_(entry) {
+    HT_KEY key;
+    HT_VAL val;
+    HT_(ref) next;
+#if HT_ENTRY_LOCKS
+    pthread_mutex_t entry_mutex;  // Fine-grained lock for entry updates
+#endif
+} HT_(entry);
+
+#define SLAB_PREFIX HT_(pool)
+#define SLAB_ENTRY HT_(entry)
+#define SLAB_ENTRIES HT_SLAB_ENTRIES
+#ifdef HT_COMPACT
+#define SLAB_NUMBERED
+#endif
+#if HT_ENTRY_LOCKS
+#define SLAB_FREE_ENTRY(e) pthread_mutex_destroy(&(e)->entry_mutex)
+#endif
+#include "ht_slab.h"
+
+static struct {
+    HT_(stripe) *stripes;
+    int num_stripes;
+    int lock_kind;              // HT_LOCK_* of the stripes under HT_POLICY_STRIPE
+
+    // The table layout below only changes with every stripe held
+    HT_(ref) *table;            // Current buckets
+    long table_size;
+    HT_(ref) *old_table;        // Buckets being rehashed, NULL when not resizing
+    long old_table_size;
+    int locks_pending;          // Stripes with old buckets left to move
+    int resizing;               // Set while a resize is in progress
+} HT_(s);
+
+// The entry r links to
+static inline HT_(entry) * HT_(at)(HT_(ref) r) {
+#ifdef HT_COMPACT
+    return HT_(pool_at)(r);
+#else
+    return r;
+#endif
+}
+
+// Hands out an entry from the calling thread's slab. Returns HT_NIL if no
+// memory, or under HT_COMPACT no slab number, is left.
+static inline HT_(ref) HT_(alloc_entry)(void) {
+#ifdef HT_COMPACT
+    return HT_(pool_alloc_ref)();
+#else
+    return HT_(pool_alloc)();
+#endif
+}
+
+// Stores val in an existing entry, or copies its value out. Under
+// HT_READ_UPDATES the stripe may be held only for reading, so another
+// thread can be storing the same value in place. The value is one
+// atomic word then, which leaves the entry at its key, value and link
+// instead of growing it by a pthread_mutex_t, and new entries have no
+// lock to set up. Relaxed order is enough: the value publishes nothing
+// else, and the entry itself was published under the stripe's lock.
+static inline void HT_(write_val)(HT_(entry) *e, HT_VAL val) {
+#if HT_ENTRY_LOCKS
+    ht_mutex_lock(&e->entry_mutex);
+    e->val = val;
+    pthread_mutex_unlock(&e->entry_mutex);
+#elif HT_READ_UPDATES
+    __atomic_store_n(&e->val, val, __ATOMIC_RELAXED);
+#else
+    e->val = val;
+#endif
+}
+
+static inline void HT_(read_val)(HT_(entry) *e, HT_VAL *val_out) {
+#if HT_ENTRY_LOCKS
+    ht_mutex_lock(&e->entry_mutex);
+    *val_out = e->val;
+    pthread_mutex_unlock(&e->entry_mutex);
+#elif HT_READ_UPDATES
+    *val_out = __atomic_load_n(&e->val, __ATOMIC_RELAXED);
+#else
+    *val_out = e->val;
+#endif
+}
+
+// Only the thread that owns the resize takes every stripe, so under
+// HT_POLICY_STRIPE it can use each stripe's own all_node for MCS locks
+// rather than needing num_stripes nodes from its per-thread pool. Elided
+// stripes are taken for real, without nesting a transaction per stripe.
+static inline void HT_(lock_all_buckets)(void) {
+    int m;
+    for (m = 0; m < HT_(s).num_stripes; m++) {
+        HT_ALL_WRLOCK(&HT_(s).stripes[m]);
+    }
+}
+
+static inline void HT_(unlock_all_buckets)(void) {
+    int m;
+    for (m = HT_(s).num_stripes - 1; m >= 0; m--) {
+        HT_ALL_WRUNLOCK(&HT_(s).stripes[m]);
+    }
+}
+
+// Moves every entry of old bucket j into the current table
+static inline void HT_(migrate_bucket)(long j) {
+    HT_(ref) r = HT_(s).old_table[j];
+    while (r != HT_NIL) {
+        HT_(entry) *e = HT_(at)(r);
+        HT_(ref) next = e->next;
+        long i = HT_HASH(e->key) & (HT_(s).table_size - 1);
+        e->next = HT_(s).table[i];
+        HT_(s).table[i] = r;
+        r = next;
+    }
+    HT_(s).old_table[j] = HT_NIL;
+}
+
+// Moves the next few old buckets guarded by stripe m, which the caller holds
+// exclusively. Returns 1 if that emptied the last old bucket of the table.
+// The cursor is stored atomically for stripe_migrated(), which reads it
+// without the lock.
+static inline int HT_(migrate_step)(int m) {
+    HT_(stripe) *s = &HT_(s).stripes[m];
+    long cursor = s->migrate_cursor;
+    int n;
+    if (HT_(s).old_table == NULL || cursor >= HT_(s).old_table_size) return 0;
+    for (n = 0; n < HT_MIGRATE_STEP && cursor < HT_(s).old_table_size; n++) {
+        HT_(migrate_bucket)(cursor);
+        cursor += HT_(s).num_stripes;
+    }
+    __atomic_store_n(&s->migrate_cursor, cursor, __ATOMIC_RELAXED);
+    return cursor >= HT_(s).old_table_size &&
+           __atomic_sub_fetch(&HT_(s).locks_pending, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+// Whether stripe m has no old buckets left to move, judged without its
+// lock. A stale answer only costs a wasted lock or a later helper.
+static inline int HT_(stripe_migrated)(int m) {
+    return __atomic_load_n(&HT_(s).stripes[m].migrate_cursor, __ATOMIC_RELAXED) >=
+           __atomic_load_n(&HT_(s).old_table_size, __ATOMIC_RELAXED);
+}
+
+// Doubles the table from outgrown buckets, unless another thread already
+// has. Only the pointer swap happens with every stripe held; entries are
+// moved over a few buckets at a time by later operations.
+static inline void HT_(start_resize)(long outgrown) {
+    int expected = 0;
+    if (!__atomic_compare_exchange_n(&HT_(s).resizing, &expected, 1, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;  // Another thread is already resizing
+    }
+    if (HT_(s).table_size != outgrown) {
+        __atomic_store_n(&HT_(s).resizing, 0, __ATOMIC_RELEASE);
+        return;
+    }
+
+    HT_(ref) *new_table = calloc(HT_(s).table_size * 2, sizeof(HT_(ref)));
+    if (!new_table) panic("No memory to grow table!");
+
+    HT_(lock_all_buckets)();
+    HT_(s).old_table = HT_(s).table;
+    __atomic_store_n(&HT_(s).old_table_size, HT_(s).table_size, __ATOMIC_RELAXED);
+    // Unlocked readers only use these as prefetch hints
+    __atomic_store_n(&HT_(s).table, new_table, __ATOMIC_RELAXED);
+    __atomic_store_n(&HT_(s).table_size, HT_(s).table_size * 2, __ATOMIC_RELAXED);
+    for (int m = 0; m < HT_(s).num_stripes; m++) {
+        __atomic_store_n(&HT_(s).stripes[m].migrate_cursor, m, __ATOMIC_RELAXED);
+    }
+    HT_(s).locks_pending = HT_(s).num_stripes;
+    HT_(unlock_all_buckets)();
+}
+
+// Releases the old buckets once all of them have been moved
+static inline void HT_(finish_resize)(void) {
+    HT_(lock_all_buckets)();
+    free(HT_(s).old_table);
+    HT_(s).old_table = NULL;
+    __atomic_store_n(&HT_(s).old_table_size, 0, __ATOMIC_RELAXED);
+    HT_(unlock_all_buckets)();
+    __atomic_store_n(&HT_(s).resizing, 0, __ATOMIC_RELEASE);
+}
+
+// Moves a step of old buckets for stripe m or, once m has none left, for
+// the next stripe that still has some. Called with no stripe held. Old
+// buckets otherwise only move under operations that hash to their stripe,
+// and a key set that never touches one would keep the resize, and so any
+// further growth, from ever finishing. Lookups under HT_SHARED_READS only
+// share their stripe, so they help here too, after checking the cursors
+// first so that a migrated stripe never has its write lock taken.
+static inline void HT_(help_resize)(int m) {
+    int k;
+    if (!__atomic_load_n(&HT_(s).resizing, __ATOMIC_RELAXED)) return;
+    for (k = 0; k < HT_(s).num_stripes; k++) {
+        int o = (m + k) & (HT_(s).num_stripes - 1);
+        if (HT_(stripe_migrated)(o)) continue;
+        HT_WRLOCK(&HT_(s).stripes[o]);
+        int migrated_last = HT_(migrate_step)(o);
+        HT_WRUNLOCK(&HT_(s).stripes[o]);
+        if (migrated_last) HT_(finish_resize)();
+        return;
+    }
+}
+
+// Ends an operation that held stripe m exclusively, after releasing it.
+// migrated_last and grow are what its migrate_step() and insert_new()
+// returned. A stripe whose own old buckets are all moved, or that has
+// outgrown the table mid-resize, helps the other stripes' along.
+static inline void HT_(end_write)(int m, int migrated_last, long grow) {
+    if (migrated_last) {
+        HT_(finish_resize)();
+    } else if (__atomic_load_n(&HT_(s).resizing, __ATOMIC_RELAXED) &&
+               (grow || HT_(stripe_migrated)(m))) {
+        HT_(help_resize)(m);
+    }
+    if (grow) HT_(start_resize)(grow);
+}
+
+// Finds key in the current table or its not yet migrated old bucket.
+// Caller holds the key's stripe.
+static inline HT_(entry) * HT_(find_entry)(unsigned h, HT_KEY key) {
+    HT_(entry) *b;
+    HT_(ref) r;
+    for (r = HT_(s).table[h & (HT_(s).table_size - 1)]; r != HT_NIL; r = b->next) {
+        b = HT_(at)(r);
+        if (HT_KEY_EQ(b->key, key)) return b;
+    }
+    if (HT_(s).old_table != NULL) {
+        for (r = HT_(s).old_table[h & (HT_(s).old_table_size - 1)]; r != HT_NIL; r = b->next) {
+            b = HT_(at)(r);
+            if (HT_KEY_EQ(b->key, key)) return b;
+        }
+    }
+    return NULL;
+}
+
+// Links a new entry for key, which isn't in the table. Caller holds
+// stripe m exclusively, which is released before panicking. Returns the
+// table size if the stripe's buckets have outgrown the load factor,
+// else 0.
+static inline long HT_(insert_new)(int m, unsigned h, HT_KEY key, HT_VAL val) {
+    HT_(ref) r = HT_(alloc_entry)();
+    if (r == HT_NIL) {
+        HT_WRUNLOCK(&HT_(s).stripes[m]);
+        panic("No memory to allocate bucket!");
+    }
+    HT_(entry) *e = HT_(at)(r);
+    long i = h & (HT_(s).table_size - 1);
+    e->key = key;
+    e->val = val;
+#if HT_ENTRY_LOCKS
+    pthread_mutex_init(&e->entry_mutex, NULL);
+#endif
+    e->next = HT_(s).table[i];
+    HT_(s).table[i] = r;
+    HT_(stripe) *s = &HT_(s).stripes[m];
+    s->entries++;
+    return s->entries > HT_(s).table_size / HT_(s).num_stripes * HT_MAX_LOAD ?
+           HT_(s).table_size : 0;
+}
+
+// Adds key or updates its value, as insert_new() otherwise
+static inline long HT_(insert_locked)(int m, unsigned h, HT_KEY key, HT_VAL val) {
+    // Check if key already exists
+    HT_(entry) *e = HT_(find_entry)(h, key);
+    if (e != NULL) {
+        HT_(write_val)(e, val);  // Update existing value
+        return 0;
+    }
+    return HT_(insert_new)(m, h, key, val);
+}
+
+// Inserts a key-value pair into the table under its stripe
+static inline void HT_(insert)(HT_KEY key, HT_VAL val) {
+    unsigned h = HT_HASH(key);
+    int m = h & (HT_(s).num_stripes - 1);
+    HT_(stripe) *s = &HT_(s).stripes[m];
+
+#if HT_READ_UPDATES
+    // First, try to find and update existing entry with read lock
+    HT_RDLOCK(s);
+    HT_(entry) *e = HT_(find_entry)(h, key);
+    if (e != NULL) {
+        // Found existing entry, update just its value in place
+        HT_(write_val)(e, val);
+        HT_RDUNLOCK(s);
+        return;
+    }
+    HT_RDUNLOCK(s);
+    // Key doesn't exist; insert_locked() checks again under the write lock
+#endif
+
+    HT_WRLOCK(s);
+    int migrated_last = HT_(migrate_step)(m);
+    long grow = HT_(insert_locked)(m, h, key, val);
+    HT_WRUNLOCK(s);
+    HT_(end_write)(m, migrated_last, grow);
+}
+
+// Looks up key and copies its value to *val_out under its stripe.
+// Allocates nothing; returns false if the key isn't in the table.
+static inline bool HT_(retrieve_into)(HT_KEY key, HT_VAL *val_out) {
+    unsigned h = HT_HASH(key);
+    int m = h & (HT_(s).num_stripes - 1);
+    HT_(stripe) *s = &HT_(s).stripes[m];
+
+#if HT_SHARED_READS
+    HT_RDLOCK(s);
+    HT_(entry) *b = HT_(find_entry)(h, key);
+    if (b != NULL) {
+        HT_(read_val)(b, val_out);
+    }
+    HT_RDUNLOCK(s);
+    HT_(help_resize)(m);
+#else
+    HT_WRLOCK(s);
+    int migrated_last = HT_(migrate_step)(m);
+    HT_(entry) *b = HT_(find_entry)(h, key);
+    if (b != NULL) {
+        HT_(read_val)(b, val_out);
+    }
+    HT_WRUNLOCK(s);
+    HT_(end_write)(m, migrated_last, 0);
+#endif
+    return b != NULL;
+}
+
+// Read-modify-write callback, see ht_update_fn in hashtable.h
+typedef bool (*HT_(update_fn))(HT_VAL *val, bool found, void *arg);
+
+// Runs fn on the value of an existing entry and stores the result if fn
+// says so. Under HT_READ_UPDATES the stripe may be held only for reading,
+// so the store is a CAS that reruns fn if another update got in first.
+static inline bool HT_(update_entry)(HT_(entry) *e, HT_(update_fn) fn, void *arg) {
+    HT_VAL v;
+    bool store;
+#if HT_ENTRY_LOCKS
+    ht_mutex_lock(&e->entry_mutex);
+    v = e->val;
+    store = fn(&v, true, arg);
+    if (store) e->val = v;
+    pthread_mutex_unlock(&e->entry_mutex);
+#elif HT_READ_UPDATES
+    HT_VAL old = __atomic_load_n(&e->val, __ATOMIC_RELAXED);
+    do {
+        v = old;
+        store = fn(&v, true, arg);
+    } while (store && !__atomic_compare_exchange_n(&e->val, &old, v, 1,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+#else
+    v = e->val;
+    store = fn(&v, true, arg);
+    if (store) e->val = v;
+#endif
+    return store;
+}
+
+// Replaces key's value by fn's result, or inserts it, in one pass under
+// the key's stripe. Returns whether fn chose to store a value.
+static inline bool HT_(upsert)(HT_KEY key, HT_(update_fn) fn, void *arg) {
+    unsigned h = HT_HASH(key);
+    int m = h & (HT_(s).num_stripes - 1);
+    HT_(stripe) *s = &HT_(s).stripes[m];
+    HT_(entry) *e;
+    bool store;
+
+#if HT_READ_UPDATES
+    // An existing key only needs the stripe for reading, as in insert()
+    HT_RDLOCK(s);
+    e = HT_(find_entry)(h, key);
+    if (e != NULL) {
+        store = HT_(update_entry)(e, fn, arg);
+        HT_RDUNLOCK(s);
+        return store;
+    }
+    HT_RDUNLOCK(s);
+#endif
+
+    HT_WRLOCK(s);
+    int migrated_last = HT_(migrate_step)(m);
+    long grow = 0;
+    e = HT_(find_entry)(h, key);
+    if (e != NULL) {
+        store = HT_(update_entry)(e, fn, arg);
+    } else {
+        HT_VAL v;
+        memset(&v, 0, sizeof(v));
+        store = fn(&v, false, arg);
+        if (store) grow = HT_(insert_new)(m, h, key, v);
+    }
+    HT_WRUNLOCK(s);
+    HT_(end_write)(m, migrated_last, grow);
+    return store;
+}
+
+// Hashes a batch, prefetching each key's stripe and bucket head, and
+// groups it by stripe with ht_group_batch(). The table may be resized
+// meanwhile, which only wastes a prefetch.
+static inline void HT_(prepare_batch)(const HT_KEY *batch_keys, int n, unsigned *hash,
+                                      int *stripe, int *order) {
+    HT_(ref) *buckets = __atomic_load_n(&HT_(s).table, __ATOMIC_RELAXED);
+    long size = __atomic_load_n(&HT_(s).table_size, __ATOMIC_RELAXED);
+    int i;
+    for (i = 0; i < n; i++) {
+        hash[i] = HT_HASH(batch_keys[i]);
+        __builtin_prefetch(&HT_(s).stripes[hash[i] & (HT_(s).num_stripes - 1)]);
+        __builtin_prefetch(&buckets[hash[i] & (size - 1)]);
+    }
+    ht_group_batch(hash, n, HT_(s).num_stripes, stripe, order);
+}
+
+// Inserts n key-value pairs, taking each stripe once per HT_BATCH_SIZE
+// keys instead of once per key. Batches always take the stripe
+// exclusively, even under HT_READ_UPDATES.
+static inline void HT_(insert_batch)(const HT_KEY *batch_keys, const HT_VAL *batch_vals,
+                                     size_t n) {
+    unsigned hash[HT_BATCH_SIZE];
+    int stripe[HT_BATCH_SIZE], order[HT_BATCH_SIZE];
+    size_t done;
+    for (done = 0; done < n; done += HT_BATCH_SIZE) {
+        int count = n - done < HT_BATCH_SIZE ? n - done : HT_BATCH_SIZE;
+        const HT_KEY *ks = batch_keys + done;
+        const HT_VAL *vs = batch_vals + done;
+        int k = 0;
+        HT_(prepare_batch)(ks, count, hash, stripe, order);
+        while (k < count) {
+            int m = stripe[order[k]];
+            long grow = 0, g;
+            HT_WRLOCK(&HT_(s).stripes[m]);
+            int migrated_last = HT_(migrate_step)(m);
+            for (; k < count && stripe[order[k]] == m; k++) {
+                if ((g = HT_(insert_locked)(m, hash[order[k]], ks[order[k]], vs[order[k]]))) {
+                    grow = g;
+                }
+            }
+            HT_WRUNLOCK(&HT_(s).stripes[m]);
+            HT_(end_write)(m, migrated_last, grow);
+        }
+    }
+}
+
+// Looks up n keys, see ht_backend, taking each stripe once per
+// HT_BATCH_SIZE keys; for reading only under HT_SHARED_READS
+static inline size_t HT_(retrieve_batch)(const HT_KEY *batch_keys, HT_VAL *vals_out,
+                                         bool *found, size_t n) {
+    unsigned hash[HT_BATCH_SIZE];
+    int stripe[HT_BATCH_SIZE], order[HT_BATCH_SIZE];
+    size_t done, hits = 0;
+    for (done = 0; done < n; done += HT_BATCH_SIZE) {
+        int count = n - done < HT_BATCH_SIZE ? n - done : HT_BATCH_SIZE;
+        const HT_KEY *ks = batch_keys + done;
+        int k = 0;
+        HT_(prepare_batch)(ks, count, hash, stripe, order);
+        while (k < count) {
+            int m = stripe[order[k]];
+#if HT_SHARED_READS
+            HT_RDLOCK(&HT_(s).stripes[m]);
+#else
+            HT_WRLOCK(&HT_(s).stripes[m]);
+            int migrated_last = HT_(migrate_step)(m);
+#endif
+            for (; k < count && stripe[order[k]] == m; k++) {
+                size_t pos = done + order[k];
+                HT_(entry) *b = HT_(find_entry)(hash[order[k]], batch_keys[pos]);
+                found[pos] = b != NULL;
+                if (b != NULL) {
+                    HT_(read_val)(b, &vals_out[pos]);
+                    hits++;
+                }
+            }
+#if HT_SHARED_READS
+            HT_RDUNLOCK(&HT_(s).stripes[m]);
+            HT_(help_resize)(m);
+#else
+            HT_WRUNLOCK(&HT_(s).stripes[m]);
+            HT_(end_write)(m, migrated_last, 0);
+#endif
+        }
+    }
+    return hits;
+}
+
+// Sets up an empty table of size buckets with cfg->num_stripes lock stripes
+static inline void HT_(setup)(const ht_config *cfg, long size) {
+    int i;
+    HT_(s).num_stripes = cfg->num_stripes;
+    HT_(s).table_size = size > HT_(s).num_stripes ? size : HT_(s).num_stripes;
+    HT_(s).table = calloc(HT_(s).table_size, sizeof(HT_(ref)));
+    HT_(pool_init)();
+    if (!HT_(s).table) {
+        panic("out of memory allocating hash table");
+    }
+    HT_(s).old_table = NULL;
+    HT_(s).old_table_size = 0;
+    HT_(s).resizing = 0;
+
+    HT_(s).stripes = aligned_alloc(CACHE_LINE, sizeof(HT_(stripe)) * HT_(s).num_stripes);
+    if (!HT_(s).stripes) {
+        panic("out of memory allocating lock stripes");
+    }
+    for (i = 0; i < HT_(s).num_stripes; i++) {
+        HT_LOCK_INIT(&HT_(s).stripes[i]);
+        HT_(s).stripes[i].migrate_cursor = 0;
+        HT_(s).stripes[i].entries = 0;
+    }
+}
+
+static inline void HT_(init)(const ht_config *cfg) {
+    HT_(setup)(cfg, HT_NUM_BUCKETS);
+}
+
+// Bulk build. With every key known up front the table is sized once and
+// filled without locks: the keys are radix-partitioned by bucket into one
+// contiguous range of buckets per thread, then each thread links its own
+// buckets' chains from its own slabs. Three passes over the input, split
+// by cfg->num_threads threads:
+//
+//   1. each thread counts its slice of the input per partition
+//   2. from everyone's counts it knows where its slice's keys go in a
+//      scratch array grouped by partition, and scatters them there
+//   3. thread p builds the buckets of partition p from its group
+//
+// The scatter is stable, so a key given twice keeps its later value as
+// with insert(). Partition p covers buckets [p * size / T, (p + 1) * size / T).
+typedef struct HT_(pair) {
+    HT_KEY key;
+    HT_VAL val;
+} HT_(pair);
+
+typedef struct HT_(builder) {
+    pthread_t thread;
+    int id;
+    long *stripe_entries;       // Entries this thread linked, per stripe
+} HT_(builder);
+
+static struct {
+    const HT_KEY *keys;
+    const HT_VAL *vals;
+    size_t n;
+    int num_threads;
+    int size_bits;              // log2 of the table size
+    const int *cpus;
+    size_t *counts;             // counts[t * num_threads + p]: slice t's keys in partition p
+    HT_(pair) *scratch;         // Input grouped by partition
+    pthread_barrier_t counted, scattered;
+} HT_(bulk);
+
+static inline int HT_(partition_of)(unsigned h) {
+    unsigned long b = h & (HT_(s).table_size - 1);
+    return (b * HT_(bulk).num_threads) >> HT_(bulk).size_bits;
+}
+
+static inline void * HT_(build_thread)(void *arg) {
+    HT_(builder) *me = arg;
+    int t = me->id, T = HT_(bulk).num_threads, p, u;
+    size_t lo = HT_(bulk).n * t / T, hi = HT_(bulk).n * (t + 1) / T, i;
+    size_t *counts = HT_(bulk).counts;
+
+    // Pin before allocating so this thread's slabs are node-local
+    if (HT_(bulk).cpus != NULL) pin_self(HT_(bulk).cpus[t]);
+
+    for (i = lo; i < hi; i++) {
+        counts[t * T + HT_(partition_of)(HT_HASH(HT_(bulk).keys[i]))]++;
+    }
+    pthread_barrier_wait(&HT_(bulk).counted);
+
+    // Partition p starts after every key of lower partitions; within it,
+    // slice t goes after the lower slices
+    size_t offset[T], start = 0, end = 0;
+    for (p = 0; p < T; p++) {
+        for (u = 0; u < T; u++) {
+            if (u == t) offset[p] = start;
+            start += counts[u * T + p];
+        }
+        if (p == t) end = start;
+    }
+    start = end;
+    for (u = 0; u < T; u++) start -= counts[u * T + t];
+    for (i = lo; i < hi; i++) {
+        HT_(pair) *d = &HT_(bulk).scratch[offset[HT_(partition_of)(HT_HASH(HT_(bulk).keys[i]))]++];
+        d->key = HT_(bulk).keys[i];
+        d->val = HT_(bulk).vals[i];
+    }
+    pthread_barrier_wait(&HT_(bulk).scattered);
+
+    // Nobody else touches this partition's buckets, so no locks; chains
+    // are built in input order, looking each key up first for duplicates
+    for (i = start; i < end; i++) {
+        HT_(pair) *d = &HT_(bulk).scratch[i];
+        unsigned h = HT_HASH(d->key);
+        long b = h & (HT_(s).table_size - 1);
+        HT_(entry) *e = NULL;
+        HT_(ref) r;
+        for (r = HT_(s).table[b]; r != HT_NIL; r = e->next) {
+            e = HT_(at)(r);
+            if (HT_KEY_EQ(e->key, d->key)) break;
+        }
+        if (r != HT_NIL) {
+            e->val = d->val;
+            continue;
+        }
+        r = HT_(alloc_entry)();
+        if (r == HT_NIL) panic("No memory to allocate bucket!");
+        e = HT_(at)(r);
+        e->key = d->key;
+        e->val = d->val;
+#if HT_ENTRY_LOCKS
+        pthread_mutex_init(&e->entry_mutex, NULL);
+#endif
+        e->next = HT_(s).table[b];
+        HT_(s).table[b] = r;
+        me->stripe_entries[h & (HT_(s).num_stripes - 1)]++;
+    }
+    return NULL;
+}
+
+// Starts a table holding keys[i] -> vals[i] for i < n, built by
+// cfg->num_threads threads as above. Used instead of init().
+static inline void HT_(build)(const ht_config *cfg, const HT_KEY *keys, const HT_VAL *vals,
+                              size_t n) {
+    int T = cfg->num_threads > 0 ? cfg->num_threads : 1;
+    int t, m;
+    long size = HT_NUM_BUCKETS;
+    while (size * HT_MAX_LOAD < (long) n) size <<= 1;
+    HT_(setup)(cfg, size);
+
+    HT_(bulk).keys = keys;
+    HT_(bulk).vals = vals;
+    HT_(bulk).n = n;
+    HT_(bulk).num_threads = T;
+    HT_(bulk).size_bits = __builtin_ctzl(HT_(s).table_size);
+    HT_(bulk).cpus = cfg->cpus;
+    HT_(bulk).counts = calloc((size_t) T * T, sizeof(size_t));
+    HT_(bulk).scratch = malloc(sizeof(HT_(pair)) * (n > 0 ? n : 1));
+    HT_(builder) *builders = calloc(T, sizeof(HT_(builder)));
+    if (!HT_(bulk).counts || !HT_(bulk).scratch || !builders) {
+        panic("out of memory for bulk build");
+    }
+    pthread_barrier_init(&HT_(bulk).counted, NULL, T);
+    pthread_barrier_init(&HT_(bulk).scattered, NULL, T);
+    for (t = 0; t < T; t++) {
+        builders[t].id = t;
+        builders[t].stripe_entries = calloc(HT_(s).num_stripes, sizeof(long));
+        if (!builders[t].stripe_entries) {
+            panic("out of memory for bulk build");
+        }
+        pthread_create(&builders[t].thread, NULL, HT_(build_thread), &builders[t]);
+    }
+    for (t = 0; t < T; t++) {
+        pthread_join(builders[t].thread, NULL);
+        for (m = 0; m < HT_(s).num_stripes; m++) {
+            HT_(s).stripes[m].entries += builders[t].stripe_entries[m];
+        }
+        free(builders[t].stripe_entries);
+    }
+    pthread_barrier_destroy(&HT_(bulk).counted);
+    pthread_barrier_destroy(&HT_(bulk).scattered);
+    free(builders);
+    free(HT_(bulk).counts);
+    free(HT_(bulk).scratch);
+}
+
+#if HT_POLICY == HT_POLICY_STRIPE
+// The same with stripes of the given HT_LOCK_* kind; init() and build()
+// keep whatever kind was set last, HT_LOCK_PTHREAD at first
+static inline void HT_(init_kind)(const ht_config *cfg, int lock_kind) {
+    HT_(s).lock_kind = lock_kind;
+    HT_(init)(cfg);
+}
+
+static inline void HT_(build_kind)(const ht_config *cfg, int lock_kind, const HT_KEY *keys,
+                                   const HT_VAL *vals, size_t n) {
+    HT_(s).lock_kind = lock_kind;
+    HT_(build)(cfg, keys, vals, n);
+}
+#endif
+
+// Memory footprint, see ht_mem_stats. Every entry handed out holds a
+// key, as nothing is removed.
+static inline void HT_(count_chains)(ht_mem_stats *out, HT_(ref) *buckets, long size) {
+    long i, len;
+    HT_(ref) r;
+    for (i = 0; i < size; i++) {
+        for (len = 0, r = buckets[i]; r != HT_NIL; r = HT_(at)(r)->next) len++;
+        ht_count_chain(out, len);
+    }
+}
+
+static inline void HT_(mem_stats)(ht_mem_stats *out) {
+    int m;
+    memset(out, 0, sizeof(*out));
+    for (m = 0; m < HT_(s).num_stripes; m++) {
+        out->keys += HT_(s).stripes[m].entries;
+    }
+    out->index_bytes = sizeof(HT_(ref)) * (HT_(s).table_size + HT_(s).old_table_size) +
+                       sizeof(HT_(stripe)) * HT_(s).num_stripes;
+    out->entry_bytes = sizeof(HT_(entry)) * out->keys;
+    out->overhead_bytes =
+        ht_alloc_overhead(HT_(s).table, sizeof(HT_(ref)) * HT_(s).table_size) +
+        ht_alloc_overhead(HT_(s).old_table, sizeof(HT_(ref)) * HT_(s).old_table_size) +
+        ht_alloc_overhead(HT_(s).stripes, sizeof(HT_(stripe)) * HT_(s).num_stripes);
+    HT_(pool_stats)(out, out->keys);
+    HT_(count_chains)(out, HT_(s).table, HT_(s).table_size);
+    if (HT_(s).old_table != NULL) {
+        HT_(count_chains)(out, HT_(s).old_table, HT_(s).old_table_size);
+    }
+}
+
+static inline void HT_(destroy)(void) {
+    int i;
+    free(HT_(s).table);
+    free(HT_(s).old_table);
+    HT_(pool_free)();
+    for (i = 0; i < HT_(s).num_stripes; i++) {
+        HT_LOCK_DESTROY(&HT_(s).stripes[i]);
+    }
+    free(HT_(s).stripes);
+}
+
+#undef HT_
+#undef HT_PREFIX
+#undef HT_POLICY
+#undef HT_KEY
+#undef HT_VAL
+#undef HT_HASH
+#undef HT_KEY_EQ
+#undef HT_NUM_BUCKETS
+#undef HT_SLAB_ENTRIES
+#undef HT_MAX_LOAD
+#undef HT_MIGRATE_STEP
+#undef HT_BATCH_SIZE
+#undef HT_LOCK_FIELD
+#undef HT_LOCK_INIT
+#undef HT_LOCK_DESTROY
+#undef HT_WRLOCK
+#undef HT_WRUNLOCK
+#undef HT_ALL_WRLOCK
+#undef HT_ALL_WRUNLOCK
+#undef HT_RDLOCK
+#undef HT_RDUNLOCK
+#undef HT_SHARED_READS
+#undef HT_READ_UPDATES
+#undef HT_ENTRY_LOCKS
+#undef HT_ENTRY_MUTEX
+#undef HT_COMPACT
+#undef HT_NIL
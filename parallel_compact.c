@@ -0,0 +1,20 @@
+// Striped chained table with pthread mutex stripes and compact links:
+// entries and bucket heads refer to entries by 32-bit arena index rather
+// than by pointer, for about a third less memory per key than "mutex"
+#define HT_PREFIX tbl
+#define HT_POLICY HT_POLICY_MUTEX
+#define HT_COMPACT
+#include "ht_template.h"
+
+const ht_backend compact_backend = {
+    .name = "compact",
+    .init = tbl_init,
+    .insert = tbl_insert,
+    .retrieve_into = tbl_retrieve_into,
+    .insert_batch = tbl_insert_batch,
+    .retrieve_batch = tbl_retrieve_batch,
+    .upsert = tbl_upsert,
+    .build = tbl_build,
+    .mem_stats = tbl_mem_stats,
+    .destroy = tbl_destroy,
+};
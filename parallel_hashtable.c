@@ -1,14 +1,14 @@
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
-#include <assert.h>
-#include <sys/time.h>
 
-#define NUM_BUCKETS 5     // Buckets in hash table
-#define NUM_KEYS 100000   // Number of keys inserted per thread
-int num_threads = 1;      // Number of threads (configurable)
-int keys[NUM_KEYS];
+#include "hashtable.h"
+
+#define NUM_BUCKETS 8     // Initial buckets in hash table, a power of two
+#define MAX_LOAD 2        // Average chain length that triggers a resize
+#define MIGRATE_STEP 2    // Old buckets moved per insert/retrieve while resizing
+#define MAX_GROWTH 24     // Number of times the table may double
+#define BATCH_SIZE 64     // Keys per insert_batch/retrieve_batch round
 
 typedef struct _bucket_entry {
   int key;
@@ -16,122 +16,510 @@ typedef struct _bucket_entry {
   struct _bucket_entry *next;
 } bucket_entry;
 
-bucket_entry *table[NUM_BUCKETS];
+#define SLAB_PREFIX pool
+#define SLAB_ENTRY bucket_entry
+#include "ht_slab.h"
+
+// tables[g] has NUM_BUCKETS << g buckets and g = table_gen receives inserts.
+// Nothing here is locked, so outgrown arrays are kept until destroy(): a racing
+// thread may still be walking one and at worst misses keys, never freed memory.
+static bucket_entry **tables[MAX_GROWTH + 1];
+static int table_gen = 0;
+static long migrate_next = 0;   // (generation << 32) | next old bucket to move
+static long migrate_done = 0;   // Old buckets moved into the current generation
+static long num_entries = 0;
+static int resizing = 0;        // Set while a resize is in progress
+
+// Counts the chains of size buckets into out, adding their entries to
+// out->keys
+static void chain_stats(ht_mem_stats *out, bucket_entry **buckets, long size) {
+  long i, len;
+  bucket_entry *e;
+  for (i = 0; i < size; i++) {
+    for (len = 0, e = buckets[i]; e != NULL; e = e->next) len++;
+    ht_count_chain(out, len);
+    out->keys += len;
+  }
+}
 
-void panic(char *msg) {
-  printf("%s\n", msg);
-  exit(1);
+// Sets out->entry_bytes from out->keys and adds the slabs' overhead,
+// counting entries handed out but no longer reachable from a bucket
+static void slab_stats(ht_mem_stats *out) {
+  out->entry_bytes = sizeof(bucket_entry) * out->keys;
+  pool_stats(out, out->keys);
 }
 
-double now() {
-  struct timeval tv;
-  gettimeofday(&tv, 0);
-  return tv.tv_sec + tv.tv_usec / 1000000.0;
+static long gen_size(int g) {
+  return (long) NUM_BUCKETS << g;
+}
+
+// Moves a few buckets of the previous generation into the current one.
+// Buckets are claimed through an atomic counter so two threads never relink
+// the same chain, which could otherwise leave a cycle behind.
+static void migrate_step() {
+  int n;
+  if (!__atomic_load_n(&resizing, __ATOMIC_ACQUIRE)) return;
+  for (n = 0; n < MIGRATE_STEP; n++) {
+    long claim = __atomic_fetch_add(&migrate_next, 1, __ATOMIC_ACQ_REL);
+    int g = claim >> 32;
+    long j = claim & 0xffffffff;
+    if (g == 0 || j >= gen_size(g - 1)) return;
+
+    bucket_entry *e = tables[g - 1][j];
+    while (e != NULL) {
+      bucket_entry *next = e->next;
+      long i = ht_hash(e->key) & (gen_size(g) - 1);
+      e->next = tables[g][i];
+      tables[g][i] = e;
+      e = next;
+    }
+    tables[g - 1][j] = NULL;
+    if (__atomic_add_fetch(&migrate_done, 1, __ATOMIC_ACQ_REL) == gen_size(g - 1))
+      __atomic_store_n(&resizing, 0, __ATOMIC_RELEASE);
+  }
+}
+
+// Doubles the table; the entries follow a few buckets per operation
+static void start_resize() {
+  int expected = 0;
+  if (!__atomic_compare_exchange_n(&resizing, &expected, 1, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;
+
+  int g = table_gen;
+  if (g == MAX_GROWTH || num_entries <= gen_size(g) * MAX_LOAD) {
+    __atomic_store_n(&resizing, 0, __ATOMIC_RELEASE);
+    return;
+  }
+  tables[g + 1] = calloc(gen_size(g + 1), sizeof(bucket_entry *));
+  if (!tables[g + 1]) panic("No memory to grow table!");
+  migrate_done = 0;
+  __atomic_store_n(&table_gen, g + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&migrate_next, (long) (g + 1) << 32, __ATOMIC_RELEASE);
 }
 
 // Inserts a key-value pair into the table
-void insert(int key, int val) {
-  int i = key % NUM_BUCKETS;
-  bucket_entry *e = (bucket_entry *) malloc(sizeof(bucket_entry));
+static void insert(int key, int val) {
+  unsigned h = ht_hash(key);
+  migrate_step();
+  int g = __atomic_load_n(&table_gen, __ATOMIC_ACQUIRE);
+  long i = h & (gen_size(g) - 1);
+  bucket_entry *e = pool_alloc();
   if (!e) panic("No memory to allocate bucket!");
-  e->next = table[i];
+  e->next = tables[g][i];
   e->key = key;
   e->val = val;
-  table[i] = e;
+  tables[g][i] = e;
+  if (__atomic_add_fetch(&num_entries, 1, __ATOMIC_RELAXED) > gen_size(g) * MAX_LOAD)
+    start_resize();
 }
 
 // Retrieves an entry from the hash table by key
 // Returns NULL if the key isn't found in the table
-bucket_entry * retrieve(int key) {
+static bucket_entry * retrieve(int key) {
   bucket_entry *b;
-  for (b = table[key % NUM_BUCKETS]; b != NULL; b = b->next) {
+  unsigned h = ht_hash(key);
+  migrate_step();
+  int g = __atomic_load_n(&table_gen, __ATOMIC_ACQUIRE);
+  for (b = tables[g][h & (gen_size(g) - 1)]; b != NULL; b = b->next) {
     if (b->key == key) return b;
   }
+  // Keys in buckets that have not been moved yet are still in the old array
+  if (g > 0 && __atomic_load_n(&resizing, __ATOMIC_ACQUIRE)) {
+    for (b = tables[g - 1][h & (gen_size(g - 1) - 1)]; b != NULL; b = b->next) {
+      if (b->key == key) return b;
+    }
+  }
   return NULL;
 }
 
-void * put_phase(void *arg) {
-  long tid = (long) arg;
-  int key = 0;
+static bool retrieve_into(int key, int *val_out) {
+  bucket_entry *b = retrieve(key);
+  if (b != NULL) *val_out = b->val;
+  return b != NULL;
+}
 
-  // If there are k threads, thread i inserts
-  //      (i, i), (i+k, i), (i+k*2)
-  for (key = tid ; key < NUM_KEYS; key += num_threads) {
-    insert(keys[key], tid);
+// Applies fn to key's value in place, or inserts the key. Like everything
+// here it is unsynchronized: concurrent updates of one key may be lost.
+static bool upsert(int key, ht_update_fn fn, void *arg) {
+  bucket_entry *b = retrieve(key);
+  int val = b != NULL ? b->val : 0;
+  if (!fn(&val, b != NULL, arg)) return false;
+  if (b != NULL) {
+    b->val = val;
+  } else {
+    insert(key, val);
   }
-
-  pthread_exit(NULL);
+  return true;
 }
 
-void * get_phase(void *arg) {
-  long tid = (long) arg;
-  int key = 0;
-  long lost = 0;
+// Prefetches the bucket heads of a batch of keys
+static void prefetch_batch(const int *batch_keys, size_t n) {
+  size_t k;
+  int g = __atomic_load_n(&table_gen, __ATOMIC_ACQUIRE);
+  for (k = 0; k < n; k++) {
+    __builtin_prefetch(&tables[g][ht_hash(batch_keys[k]) & (gen_size(g) - 1)]);
+  }
+}
 
-  for (key = tid ; key < NUM_KEYS; key += num_threads) {
-    if (retrieve(keys[key]) == NULL) lost++;
+// Inserts n key-value pairs. Each round prefetches the bucket heads of
+// BATCH_SIZE keys up front so their cache misses overlap.
+static void insert_batch(const int *batch_keys, const int *batch_vals, size_t n) {
+  size_t done, k;
+  for (done = 0; done < n; done += BATCH_SIZE) {
+    size_t count = n - done < BATCH_SIZE ? n - done : BATCH_SIZE;
+    prefetch_batch(batch_keys + done, count);
+    for (k = done; k < done + count; k++) {
+      insert(batch_keys[k], batch_vals[k]);
+    }
   }
-  printf("[thread %ld] %ld keys lost!\n", tid, lost);
+}
 
-  pthread_exit((void *)lost);
+// Looks up n keys, see ht_backend, prefetching BATCH_SIZE bucket heads
+// at a time
+static size_t retrieve_batch(const int *batch_keys, int *vals_out, bool *found, size_t n) {
+  size_t done, k, hits = 0;
+  for (done = 0; done < n; done += BATCH_SIZE) {
+    size_t count = n - done < BATCH_SIZE ? n - done : BATCH_SIZE;
+    prefetch_batch(batch_keys + done, count);
+    for (k = done; k < done + count; k++) {
+      bucket_entry *b = retrieve(batch_keys[k]);
+      found[k] = b != NULL;
+      if (b != NULL) {
+        vals_out[k] = b->val;
+        hits++;
+      }
+    }
+  }
+  return hits;
 }
 
-int main(int argc, char **argv) {
-  long i;
-  pthread_t *threads;
-  double start, end;
+static void init(const ht_config *cfg) {
+  (void) cfg;           // The table starts small and grows
+  tables[0] = calloc(gen_size(0), sizeof(bucket_entry *));
+  if (!tables[0]) {
+    panic("out of memory allocating hash table");
+  }
+  table_gen = 0;
+  migrate_next = 0;
+  migrate_done = 0;
+  num_entries = 0;
+  resizing = 0;
+  pool_init();
+}
 
-  if (argc != 2) {
-    panic("usage: ./parallel_hashtable <num_threads>");
+// Memory footprint, see ht_mem_stats. Outgrown bucket arrays stay
+// allocated until destroy(), so they count towards index_bytes.
+static void mem_stats(ht_mem_stats *out) {
+  int g;
+  memset(out, 0, sizeof(*out));
+  for (g = 0; g <= table_gen; g++) {
+    out->index_bytes += sizeof(bucket_entry *) * gen_size(g);
+    out->overhead_bytes += ht_alloc_overhead(tables[g], sizeof(bucket_entry *) * gen_size(g));
   }
-  if ((num_threads = atoi(argv[1])) <= 0) {
-    panic("must enter a valid number of threads to run");
+  chain_stats(out, tables[table_gen], gen_size(table_gen));
+  if (table_gen > 0 && resizing) {
+    chain_stats(out, tables[table_gen - 1], gen_size(table_gen - 1));
   }
+  slab_stats(out);
+}
 
-  srandom(time(NULL));
-  for (i = 0; i < NUM_KEYS; i++)
-    keys[i] = random();
-
-  threads = (pthread_t *) malloc(sizeof(pthread_t)*num_threads);
-  if (!threads) {
-    panic("out of memory allocating thread handles");
+static void destroy(void) {
+  int g;
+  for (g = 0; g <= table_gen; g++) {
+    free(tables[g]);
+    tables[g] = NULL;
   }
+  pool_free();
+}
+
+const ht_backend unsync_backend = {
+  .name = "none",
+  .init = init,
+  .insert = insert,
+  .retrieve_into = retrieve_into,
+  .insert_batch = insert_batch,
+  .retrieve_batch = retrieve_batch,
+  .upsert = upsert,
+  .mem_stats = mem_stats,
+  .destroy = destroy,
+};
+
+// Private mode ("private"). Every thread inserts into a table of its own,
+// so bulk loads run with no shared writes and lose nothing. flush() then
+// publishes each of the thread's chains onto the shared bucket with one
+// CAS, which the harness does at the end of every phase. The shared and
+// private tables use one fixed bucket count, sized in init() from
+// expected_keys like parallel_lockfree.c, so a private chain always lands
+// on exactly one shared bucket. Published entries never move or leave
+// their chain again, which is what makes the unlocked read path safe.
+//
+// Every key has one entry. A key put twice before a flush keeps one
+// private entry, and flush() stores the value of a private entry whose
+// key is already published into the published entry, atomically since
+// readers load it unlocked, instead of splicing a second one. Puts of one
+// key by two threads still resolve to whichever thread flushed last, and
+// updates only combine within a thread, so read-modify-write mixes lose
+// writes; bench skips this backend under -m.
+typedef struct private_bucket {
+  bucket_entry *head;
+  bucket_entry *tail;   // Gets the shared chain appended when spliced
+} private_bucket;
+
+typedef struct private_table {
+  private_bucket *buckets;
+  long *used;           // Non-empty buckets, so flush() skips the rest
+  long num_used;
+  struct private_table *next;  // Every table is on all_private for destroy()
+} private_table;
+
+static bucket_entry **shared;       // Published chains
+static long shared_size;            // Always a power of two
+static private_table *all_private;
+static unsigned private_generation;  // Bumped by every private_init()
+static __thread private_table *my_private;  // The calling thread's table,
+static __thread unsigned my_private_generation;  // if this is private_generation
 
-  // Insert keys in parallel
-  start = now();
-  for (i = 0; i < num_threads; i++) {
-    pthread_create(&threads[i], NULL, put_phase, (void *)i);
+// The calling thread's table, NULL before its first insert. A table left
+// from before the last private_init() is freed, so only its generation is
+// looked at.
+static private_table * current_private() {
+  return my_private_generation == private_generation ? my_private : NULL;
+}
+
+// Sets up the calling thread's private table on its first insert
+static private_table * get_private() {
+  private_table *t = current_private();
+  if (t != NULL) return t;
+  t = (private_table *) malloc(sizeof(private_table));
+  if (!t) panic("No memory to allocate private table!");
+  t->buckets = calloc(shared_size, sizeof(private_bucket));
+  t->used = (long *) malloc(sizeof(long) * shared_size);
+  if (!t->buckets || !t->used) panic("No memory to allocate private table!");
+  t->num_used = 0;
+  t->next = __atomic_load_n(&all_private, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&all_private, &t->next, t, 0,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  my_private = t;
+  my_private_generation = private_generation;
+  return t;
+}
+
+// Inserts a key-value pair into the calling thread's private table, or
+// replaces the value of the key's unflushed entry. It is visible to other
+// threads once this thread calls flush().
+static void private_insert(int key, int val) {
+  private_table *t = get_private();
+  long i = ht_hash(key) & (shared_size - 1);
+  private_bucket *b = &t->buckets[i];
+  bucket_entry *e;
+  for (e = b->head; e != NULL; e = e->next) {
+    if (e->key == key) {
+      e->val = val;
+      return;
+    }
+  }
+  e = pool_alloc();
+  if (!e) panic("No memory to allocate bucket!");
+  e->key = key;
+  e->val = val;
+  e->next = b->head;
+  if (b->head == NULL) {
+    b->tail = e;
+    t->used[t->num_used++] = i;
   }
+  b->head = e;
+}
 
-  // Barrier
-  for (i = 0; i < num_threads; i++) {
-    pthread_join(threads[i], NULL);
+// Looks in the calling thread's unflushed entries, then in the shared
+// chain, whose head is loaded with acquire so the entries behind it are
+// complete
+static bucket_entry * private_retrieve(unsigned h, int key) {
+  long i = h & (shared_size - 1);
+  private_table *t = current_private();
+  bucket_entry *b;
+  if (t != NULL) {
+    for (b = t->buckets[i].head; b != NULL; b = b->next) {
+      if (b->key == key) return b;
+    }
+  }
+  for (b = __atomic_load_n(&shared[i], __ATOMIC_ACQUIRE); b != NULL; b = b->next) {
+    if (b->key == key) return b;
   }
-  end = now();
+  return NULL;
+}
 
-  printf("[main] Inserted %d keys in %f seconds\n", NUM_KEYS, end - start);
+static bool private_retrieve_into(int key, int *val_out) {
+  bucket_entry *b = private_retrieve(ht_hash(key), key);
+  if (b != NULL) *val_out = __atomic_load_n(&b->val, __ATOMIC_RELAXED);
+  return b != NULL;
+}
 
-  // Reset the thread array
-  memset(threads, 0, sizeof(pthread_t)*num_threads);
+// Applies fn to the value this thread sees for key. An unflushed entry of
+// the calling thread is updated in place; a published one is never
+// written again, so its new value goes into a private entry that shadows
+// it once flushed, as a private_insert() of the key would. Like inserts,
+// updates only become visible at flush(), and updates of one key by
+// different threads don't combine: ht_fetch_add() is only exact while
+// each key has one writer.
+static bool private_upsert(int key, ht_update_fn fn, void *arg) {
+  bucket_entry *b = private_retrieve(ht_hash(key), key);
+  int val = b != NULL ? __atomic_load_n(&b->val, __ATOMIC_RELAXED) : 0;
+  if (!fn(&val, b != NULL, arg)) return false;
+  private_insert(key, val);
+  return true;
+}
+
+// Inserts n key-value pairs into the private table, prefetching the
+// private bucket heads of BATCH_SIZE keys at a time
+static void private_insert_batch(const int *batch_keys, const int *batch_vals, size_t n) {
+  private_table *t = get_private();
+  size_t done, k;
+  for (done = 0; done < n; done += BATCH_SIZE) {
+    size_t count = n - done < BATCH_SIZE ? n - done : BATCH_SIZE;
+    for (k = done; k < done + count; k++) {
+      __builtin_prefetch(&t->buckets[ht_hash(batch_keys[k]) & (shared_size - 1)], 1);
+    }
+    for (k = done; k < done + count; k++) {
+      private_insert(batch_keys[k], batch_vals[k]);
+    }
+  }
+}
+
+// Looks up n keys, see ht_backend, prefetching BATCH_SIZE shared bucket
+// heads at a time
+static size_t private_retrieve_batch(const int *batch_keys, int *vals_out, bool *found,
+                                     size_t n) {
+  unsigned hash[BATCH_SIZE];
+  size_t done, k, hits = 0;
+  for (done = 0; done < n; done += BATCH_SIZE) {
+    size_t count = n - done < BATCH_SIZE ? n - done : BATCH_SIZE;
+    for (k = 0; k < count; k++) {
+      hash[k] = ht_hash(batch_keys[done + k]);
+      __builtin_prefetch(&shared[hash[k] & (shared_size - 1)]);
+    }
+    for (k = done; k < done + count; k++) {
+      bucket_entry *b = private_retrieve(hash[k - done], batch_keys[k]);
+      found[k] = b != NULL;
+      if (b != NULL) {
+        vals_out[k] = __atomic_load_n(&b->val, __ATOMIC_RELAXED);
+        hits++;
+      }
+    }
+  }
+  return hits;
+}
 
-  // Retrieve keys in parallel
-  start = now();
-  for (i = 0; i < num_threads; i++) {
-    pthread_create(&threads[i], NULL, get_phase, (void *)i);
+// Stores the value of every entry of private bucket b whose key is among
+// the published entries from from up to stop into the published entry,
+// and unlinks it from b. The unlinked entries stay in their slab.
+static void merge_published(private_bucket *b, bucket_entry *from, bucket_entry *stop) {
+  bucket_entry **link = &b->head;
+  bucket_entry *e, *s;
+  b->tail = NULL;
+  while ((e = *link) != NULL) {
+    for (s = from; s != stop && s->key != e->key; s = s->next);
+    if (s != stop) {
+      __atomic_store_n(&s->val, e->val, __ATOMIC_RELAXED);
+      *link = e->next;
+    } else {
+      b->tail = e;
+      link = &e->next;
+    }
   }
+}
 
-  // Collect count of lost keys
-  long total_lost = 0;
-  long *lost_keys = (long *) malloc(sizeof(long) * num_threads);
-  for (i = 0; i < num_threads; i++) {
-    pthread_join(threads[i], (void **)&lost_keys[i]);
-    total_lost += lost_keys[i];
+// Publishes the calling thread's private chains. Keys already published
+// are merged into their entries first; the rest of each chain is spliced
+// in front of its shared bucket whole: its tail is pointed at the current
+// head and the head swung to the chain with a release CAS. A CAS that
+// loses to another thread's flush of the same bucket only checks the
+// entries that flush added before retrying. Threads flushing in parallel
+// only contend on the buckets they share.
+static void private_flush(void) {
+  private_table *t = current_private();
+  long k;
+  if (t == NULL) return;
+  for (k = 0; k < t->num_used; k++) {
+    long i = t->used[k];
+    private_bucket *b = &t->buckets[i];
+    bucket_entry *old = __atomic_load_n(&shared[i], __ATOMIC_ACQUIRE);
+    bucket_entry *checked = NULL;  // Published entries from here on are merged
+    for (;;) {
+      bucket_entry *seen = old;
+      merge_published(b, old, checked);
+      if (b->head == NULL) break;
+      b->tail->next = old;
+      if (__atomic_compare_exchange_n(&shared[i], &old, b->head, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+        break;
+      }
+      b->tail->next = NULL;
+      checked = seen;
+      STAT_ADD(spin_iterations, 1);
+    }
+    b->head = b->tail = NULL;
   }
-  end = now();
+  t->num_used = 0;
+}
 
-  printf("[main] Retrieved %ld/%d keys in %f seconds\n", NUM_KEYS - total_lost, NUM_KEYS, end - start);
+// Sizes the fixed bucket count for cfg->expected_keys entries
+static void private_init(const ht_config *cfg) {
+  for (shared_size = 1; shared_size * MAX_LOAD < cfg->expected_keys; shared_size <<= 1);
+  shared = calloc(shared_size, sizeof(bucket_entry *));
+  if (!shared) {
+    panic("out of memory allocating hash table");
+  }
+  all_private = NULL;
+  private_generation++;
+  pool_init();
+}
 
-  return 0;
+// Memory footprint, see ht_mem_stats. Every thread's private table spans
+// the whole bucket range; their chains are empty once flushed.
+static void private_mem_stats(ht_mem_stats *out) {
+  private_table *t;
+  long i, len;
+  bucket_entry *e;
+  memset(out, 0, sizeof(*out));
+  out->index_bytes = sizeof(bucket_entry *) * shared_size;
+  out->overhead_bytes = ht_alloc_overhead(shared, sizeof(bucket_entry *) * shared_size);
+  chain_stats(out, shared, shared_size);
+  for (t = all_private; t != NULL; t = t->next) {
+    out->index_bytes += (sizeof(private_bucket) + sizeof(long)) * shared_size +
+                        sizeof(private_table);
+    out->overhead_bytes += ht_alloc_overhead(t, sizeof(private_table)) +
+                           ht_alloc_overhead(t->buckets, sizeof(private_bucket) * shared_size) +
+                           ht_alloc_overhead(t->used, sizeof(long) * shared_size);
+    for (i = 0; i < shared_size; i++) {
+      for (len = 0, e = t->buckets[i].head; e != NULL; e = e->next) len++;
+      out->keys += len;
+    }
+  }
+  slab_stats(out);
 }
 
+static void private_destroy(void) {
+  while (all_private != NULL) {
+    private_table *next = all_private->next;
+    free(all_private->buckets);
+    free(all_private->used);
+    free(all_private);
+    all_private = next;
+  }
+  free(shared);
+  pool_free();
+}
 
+const ht_backend private_backend = {
+  .name = "private",
+  .init = private_init,
+  .insert = private_insert,
+  .retrieve_into = private_retrieve_into,
+  .insert_batch = private_insert_batch,
+  .retrieve_batch = private_retrieve_batch,
+  .upsert = private_upsert,
+  .flush = private_flush,
+  .mem_stats = private_mem_stats,
+  .destroy = private_destroy,
+};
@@ -0,0 +1,256 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "hashtable.h"
+
+#define INLINE_SLOTS 5    // Key/value pairs stored in the bucket header
+#define TARGET_LOAD 2     // Average keys per bucket the table is sized for
+#define BATCH_SIZE 64     // Keys per insert_batch/retrieve_batch round
+
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+typedef struct bucket_entry {
+    int key;
+    int val;
+    struct bucket_entry *next;
+} bucket_entry;
+
+// One bucket is exactly one cache line: its lock, a tag byte per inline
+// slot, the inline slots themselves and the overflow chain. A lookup that
+// hits an inline slot touches nothing else, so it costs one cache miss,
+// and writers to neighbouring buckets never share a line.
+//
+// tags holds one byte per used slot, a fingerprint of the key with the
+// top bit set, so unused bytes (zero) never match. All tags are compared
+// against the probe's at once as one 64-bit word.
+typedef struct bucket {
+    int lock;             // ht_futex_lock word
+    int count;            // Inline slots in use
+    uint64_t tags;        // Byte i tags keys[i]
+    int keys[INLINE_SLOTS];
+    int vals[INLINE_SLOTS];
+    bucket_entry *overflow;  // Keys beyond the inline slots
+} __attribute__((aligned(CACHE_LINE))) bucket;
+
+_Static_assert(sizeof(bucket) == CACHE_LINE, "bucket header must fill one cache line");
+
+// Overflow entries come from ht_slab.h
+#define SLAB_PREFIX pool
+#define SLAB_ENTRY bucket_entry
+#include "ht_slab.h"
+
+// Every bucket carries its own lock, so there is nothing to take for a
+// resize; like parallel_lockfree.c the bucket count is fixed in init()
+// and keys past the inline slots overflow into the chain.
+static bucket *table;
+static long num_buckets;  // Always a power of two
+
+// The bucket comes from the low bits of the key's hash h, the tag from
+// its top bits, which the bucket index doesn't use
+static bucket * bucket_for(unsigned h) {
+    return &table[h & (num_buckets - 1)];
+}
+
+// Under HASH=identity h is the key itself, whose top bits are zero for
+// every key below 2^25, so there the tag comes from the top bits of h
+// times the golden ratio, which depend on all of h
+static uint64_t tag_of(unsigned h) {
+#ifdef HT_HASH_IDENTITY
+    h *= 0x9e3779b1u;
+#endif
+    return (h >> 25) | 0x80;
+}
+
+// Returns the inline slot holding key, or -1. Caller holds the bucket lock.
+static int find_inline(bucket *b, unsigned h, int key) {
+    // Bytes equal to the probe's tag become zero; the classic zero-byte
+    // test then flags them, with no false negatives
+    uint64_t x = b->tags ^ (tag_of(h) * ONES);
+    uint64_t hits = (x - ONES) & ~x & HIGHS;
+    while (hits != 0) {
+        int i = __builtin_ctzll(hits) / 8;
+        if (i < b->count && b->keys[i] == key) return i;
+        hits &= hits - 1;
+    }
+    return -1;
+}
+
+static bucket_entry * find_overflow(bucket *b, int key) {
+    bucket_entry *e;
+    for (e = b->overflow; e != NULL; e = e->next) {
+        if (e->key == key) return e;
+    }
+    return NULL;
+}
+
+// Adds key or updates its value. Caller holds the bucket lock, which is
+// released before panicking.
+static void insert_locked(bucket *b, unsigned h, int key, int val) {
+    int i = find_inline(b, h, key);
+    if (i >= 0) {
+        b->vals[i] = val;  // Update existing value
+        return;
+    }
+    bucket_entry *e = find_overflow(b, key);
+    if (e != NULL) {
+        e->val = val;
+        return;
+    }
+
+    if (b->count < INLINE_SLOTS) {
+        i = b->count++;
+        b->keys[i] = key;
+        b->vals[i] = val;
+        b->tags |= tag_of(h) << (8 * i);
+        return;
+    }
+    e = pool_alloc();
+    if (!e) {
+        ht_futex_unlock(&b->lock);
+        panic("No memory to allocate bucket!");
+    }
+    e->key = key;
+    e->val = val;
+    e->next = b->overflow;
+    b->overflow = e;
+}
+
+// Copies the value of key to *val_out. Caller holds the bucket lock.
+static bool retrieve_locked(bucket *b, unsigned h, int key, int *val_out) {
+    int i = find_inline(b, h, key);
+    if (i >= 0) {
+        *val_out = b->vals[i];
+        return true;
+    }
+    bucket_entry *e = find_overflow(b, key);
+    if (e == NULL) return false;
+    *val_out = e->val;
+    return true;
+}
+
+// Inserts a key-value pair into the table under the bucket's own lock
+static void insert(int key, int val) {
+    unsigned h = ht_hash(key);
+    bucket *b = bucket_for(h);
+    ht_futex_lock(&b->lock);
+    insert_locked(b, h, key, val);
+    ht_futex_unlock(&b->lock);
+}
+
+// Looks up key and copies its value to *val_out under the bucket lock.
+// Allocates nothing; returns false if the key isn't in the table.
+static bool retrieve_into(int key, int *val_out) {
+    unsigned h = ht_hash(key);
+    bucket *b = bucket_for(h);
+    ht_futex_lock(&b->lock);
+    bool found = retrieve_locked(b, h, key, val_out);
+    ht_futex_unlock(&b->lock);
+    return found;
+}
+
+// Applies fn to key's value, or inserts the key, under the bucket lock
+static bool upsert(int key, ht_update_fn fn, void *arg) {
+    unsigned h = ht_hash(key);
+    bucket *b = bucket_for(h);
+    int val = 0;
+    ht_futex_lock(&b->lock);
+    bool found = retrieve_locked(b, h, key, &val);
+    bool store = fn(&val, found, arg);
+    if (store) insert_locked(b, h, key, val);
+    ht_futex_unlock(&b->lock);
+    return store;
+}
+
+// Prefetches the bucket headers of a batch of keys for writing, since
+// even a lookup writes the lock word
+static void prefetch_batch(const int *batch_keys, size_t n) {
+    size_t k;
+    for (k = 0; k < n; k++) {
+        __builtin_prefetch(bucket_for(ht_hash(batch_keys[k])), 1);
+    }
+}
+
+// Inserts n key-value pairs. Each round prefetches the bucket headers of
+// BATCH_SIZE keys up front so their cache misses overlap.
+static void insert_batch(const int *batch_keys, const int *batch_vals, size_t n) {
+    size_t done, k;
+    for (done = 0; done < n; done += BATCH_SIZE) {
+        size_t count = n - done < BATCH_SIZE ? n - done : BATCH_SIZE;
+        prefetch_batch(batch_keys + done, count);
+        for (k = done; k < done + count; k++) {
+            insert(batch_keys[k], batch_vals[k]);
+        }
+    }
+}
+
+// Looks up n keys, see ht_backend, prefetching BATCH_SIZE bucket lines
+// at a time
+static size_t retrieve_batch(const int *batch_keys, int *vals_out, bool *found, size_t n) {
+    size_t done, k, hits = 0;
+    for (done = 0; done < n; done += BATCH_SIZE) {
+        size_t count = n - done < BATCH_SIZE ? n - done : BATCH_SIZE;
+        prefetch_batch(batch_keys + done, count);
+        for (k = done; k < done + count; k++) {
+            found[k] = retrieve_into(batch_keys[k], &vals_out[k]);
+            hits += found[k];
+        }
+    }
+    return hits;
+}
+
+// Sizes the fixed bucket array for cfg->expected_keys entries
+static void init(const ht_config *cfg) {
+    for (num_buckets = 1; num_buckets * TARGET_LOAD < cfg->expected_keys; num_buckets <<= 1);
+    table = aligned_alloc(CACHE_LINE, sizeof(bucket) * num_buckets);
+    if (!table) {
+        panic("out of memory allocating hash table");
+    }
+    memset(table, 0, sizeof(bucket) * num_buckets);
+    pool_init();
+}
+
+// Memory footprint, see ht_mem_stats. A bucket's header fields are
+// index, its used inline slots and its overflow entries are entries, and
+// its free inline slots overhead. A bucket's chain length counts its
+// inline keys too.
+static void mem_stats(ht_mem_stats *out) {
+    size_t slot_bytes = sizeof(int) * 2;
+    size_t header_bytes = sizeof(bucket) - slot_bytes * INLINE_SLOTS;
+    long i, len, overflow = 0;
+    bucket_entry *e;
+    memset(out, 0, sizeof(*out));
+    out->index_bytes = header_bytes * num_buckets;
+    out->overhead_bytes = ht_alloc_overhead(table, sizeof(bucket) * num_buckets);
+    for (i = 0; i < num_buckets; i++) {
+        len = table[i].count;
+        out->overhead_bytes += slot_bytes * (INLINE_SLOTS - table[i].count);
+        for (e = table[i].overflow; e != NULL; e = e->next) {
+            len++;
+            overflow++;
+        }
+        ht_count_chain(out, len);
+        out->keys += len;
+    }
+    out->entry_bytes = slot_bytes * (out->keys - overflow) + sizeof(bucket_entry) * overflow;
+    pool_stats(out, overflow);
+}
+
+static void destroy(void) {
+    free(table);
+    pool_free();
+}
+
+const ht_backend inline_backend = {
+    .name = "inline",
+    .init = init,
+    .insert = insert,
+    .retrieve_into = retrieve_into,
+    .insert_batch = insert_batch,
+    .retrieve_batch = retrieve_batch,
+    .upsert = upsert,
+    .mem_stats = mem_stats,
+    .destroy = destroy,
+};
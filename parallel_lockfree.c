@@ -0,0 +1,433 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "hashtable.h"
+
+#define MAX_LOAD 1        // Average chain length the table is sized for
+#define BATCH_SIZE 64     // Keys per insert_batch/retrieve_batch round
+#define RETIRE_BATCH 64   // Removed entries between attempts to advance the epoch
+
+typedef struct bucket_entry {
+    int key;
+    int val;              // Updated with atomic stores
+    struct bucket_entry *next;  // Low bit set once the entry is removed
+    struct bucket_entry *retired_next;  // Limbo or free list link, see below
+} bucket_entry;
+
+#define SLAB_PREFIX pool
+#define SLAB_ENTRY bucket_entry
+#include "ht_slab.h"
+
+// Lock-free chains: entries are only ever prepended with a CAS on the bucket
+// head, so readers can walk a chain without any lock. Relinking entries
+// into a bigger array under running readers is not possible this way, so
+// the bucket count is fixed up front in init().
+//
+// remove() works as in Harris's list: it first sets the low bit of the
+// entry's next pointer, which deletes it logically and stops anyone from
+// linking behind it, then CASes it out of the chain. Whoever wins that
+// CAS retires the entry.
+static bucket_entry **table;
+static long num_buckets;  // Always a power of two
+
+// Epoch-based reclamation. Every operation runs inside an epoch section,
+// announced in its thread's record. A retired entry may still be walked
+// by readers that entered before it was unlinked, so it sits in a limbo
+// list tagged with the global epoch of its retirement. Once the global
+// epoch is two further on, every such reader has left and the entry
+// moves to the thread's free list for alloc_entry() to reuse. The
+// global epoch only advances when every thread inside a section has
+// announced the current one.
+typedef struct thread_epoch {
+    unsigned long state;  // (epoch << 1) | 1 inside a section, 0 outside
+    struct thread_epoch *next;  // Every record is on all_epochs
+    bucket_entry *limbo[3];     // Retired entries, by epoch % 3
+    unsigned long limbo_epoch[3];
+    bucket_entry *free_list;    // Entries past their grace period
+    int retired;          // Retires since the last advance attempt
+} __attribute__((aligned(CACHE_LINE))) thread_epoch;
+
+static __thread thread_epoch *my_epoch;  // The calling thread's record,
+static __thread unsigned my_epoch_generation;  // if this is epoch_generation
+static unsigned epoch_generation;        // Bumped by every init()
+static thread_epoch *all_epochs;
+static unsigned long global_epoch;
+
+static int is_marked(bucket_entry *p) {
+    return (uintptr_t) p & 1;
+}
+
+static bucket_entry * unmarked(bucket_entry *p) {
+    return (bucket_entry *) ((uintptr_t) p & ~(uintptr_t) 1);
+}
+
+static bucket_entry * marked(bucket_entry *p) {
+    return (bucket_entry *) ((uintptr_t) p | 1);
+}
+
+// Announces the current global epoch for the calling thread. Entries
+// found from here on stay valid until epoch_exit().
+static thread_epoch * epoch_enter() {
+    // A record left from before the last init() is freed, along with
+    // everything on its lists, so only its generation is looked at
+    thread_epoch *r = my_epoch_generation == epoch_generation ? my_epoch : NULL;
+    if (r == NULL) {
+        r = aligned_alloc(CACHE_LINE, sizeof(thread_epoch));
+        if (!r) panic("No memory for epoch record!");
+        memset(r, 0, sizeof(thread_epoch));
+        r->next = __atomic_load_n(&all_epochs, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&all_epochs, &r->next, r, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        my_epoch = r;
+        my_epoch_generation = epoch_generation;
+    }
+    unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&r->state, (e << 1) | 1, __ATOMIC_RELAXED);
+    // The announcement must be visible before any chain is read
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return r;
+}
+
+static void epoch_exit(thread_epoch *r) {
+    __atomic_store_n(&r->state, 0, __ATOMIC_RELEASE);
+}
+
+// Moves limbo list i to the free list
+static void reclaim(thread_epoch *r, int i) {
+    while (r->limbo[i] != NULL) {
+        bucket_entry *e = r->limbo[i];
+        r->limbo[i] = e->retired_next;
+        e->retired_next = r->free_list;
+        r->free_list = e;
+    }
+}
+
+// Advances the global epoch if every thread in a section has caught up
+// with it, then reclaims whatever is two epochs old
+static void try_advance(thread_epoch *self) {
+    unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    thread_epoch *r;
+    int i;
+    for (r = __atomic_load_n(&all_epochs, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        unsigned long s = __atomic_load_n(&r->state, __ATOMIC_SEQ_CST);
+        if ((s & 1) && (s >> 1) != e) return;
+    }
+    if (__atomic_compare_exchange_n(&global_epoch, &e, e + 1, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        e++;
+    }
+    for (i = 0; i < 3; i++) {
+        if (self->limbo_epoch[i] + 2 <= e) reclaim(self, i);
+    }
+}
+
+// Hands an entry that was unlinked from its chain to the reclaimer
+static void retire(thread_epoch *r, bucket_entry *e) {
+    unsigned long now = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    int i = now % 3;
+    if (r->limbo_epoch[i] != now) {
+        // Whatever is still there is at least three epochs old
+        reclaim(r, i);
+        r->limbo_epoch[i] = now;
+    }
+    e->retired_next = r->limbo[i];
+    r->limbo[i] = e;
+    if (++r->retired >= RETIRE_BATCH) {
+        r->retired = 0;
+        try_advance(r);
+    }
+}
+
+// Hands out a reclaimed entry, or a fresh one from the calling thread's
+// slab. Returns NULL if no memory is left.
+static bucket_entry * alloc_entry(thread_epoch *r) {
+    if (r->free_list != NULL) {
+        bucket_entry *e = r->free_list;
+        r->free_list = e->retired_next;
+        return e;
+    }
+    return pool_alloc();
+}
+
+// Inserts a key-value pair into the table without taking any lock
+static void insert(int key, int val) {
+    bucket_entry **head = &table[ht_hash(key) & (num_buckets - 1)];
+    thread_epoch *r = epoch_enter();
+    bucket_entry *first = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+    bucket_entry *checked = NULL;  // Entries from here on were already searched
+    bucket_entry *e = NULL;
+
+    for (;;) {
+        // Check if key already exists among the entries we haven't seen yet.
+        // A removed entry may take checked out of the chain; then the walk
+        // simply goes on to the end.
+        bucket_entry *current, *next;
+        for (current = first; current != NULL && current != checked; current = unmarked(next)) {
+            next = __atomic_load_n(&current->next, __ATOMIC_ACQUIRE);
+            if (current->key == key && !is_marked(next)) {
+                __atomic_store_n(&current->val, val, __ATOMIC_RELAXED);
+                if (e != NULL) {
+                    // Hand back the unused entry, no one else has seen it
+                    e->retired_next = r->free_list;
+                    r->free_list = e;
+                }
+                epoch_exit(r);
+                return;
+            }
+        }
+
+        if (e == NULL) {
+            e = alloc_entry(r);
+            if (!e) panic("No memory to allocate bucket!");
+            e->key = key;
+            e->val = val;
+        }
+        e->next = first;
+        if (__atomic_compare_exchange_n(head, &first, e, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+            epoch_exit(r);
+            return;
+        }
+        // Lost the race: first is now the new head, only the entries
+        // pushed in front of our old snapshot need to be searched again
+        checked = e->next;
+        STAT_ADD(spin_iterations, 1);
+    }
+}
+
+// Applies fn to key's value without taking any lock. An existing value is
+// replaced by CAS, rerunning fn whenever another thread changed it first;
+// a missing key is pushed as in insert(), and if a racing insert of the
+// same key wins, fn runs again on that entry's value.
+static bool upsert(int key, ht_update_fn fn, void *arg) {
+    bucket_entry **head = &table[ht_hash(key) & (num_buckets - 1)];
+    thread_epoch *r = epoch_enter();
+    bucket_entry *first = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+    bucket_entry *checked = NULL;  // Entries from here on were already searched
+    bucket_entry *e = NULL;
+    bool store;
+
+    for (;;) {
+        bucket_entry *current, *next;
+        for (current = first; current != NULL && current != checked; current = unmarked(next)) {
+            next = __atomic_load_n(&current->next, __ATOMIC_ACQUIRE);
+            if (current->key == key && !is_marked(next)) {
+                int old = __atomic_load_n(&current->val, __ATOMIC_RELAXED), val;
+                for (;;) {
+                    val = old;
+                    store = fn(&val, true, arg);
+                    if (!store || __atomic_compare_exchange_n(&current->val, &old, val, 1,
+                                                              __ATOMIC_RELAXED,
+                                                              __ATOMIC_RELAXED)) {
+                        break;
+                    }
+                    STAT_ADD(spin_iterations, 1);
+                }
+                if (e != NULL) {
+                    // Hand back the unused entry, no one else has seen it
+                    e->retired_next = r->free_list;
+                    r->free_list = e;
+                }
+                epoch_exit(r);
+                return store;
+            }
+        }
+
+        if (e == NULL) {
+            int val = 0;
+            if (!fn(&val, false, arg)) {
+                epoch_exit(r);
+                return false;
+            }
+            e = alloc_entry(r);
+            if (!e) panic("No memory to allocate bucket!");
+            e->key = key;
+            e->val = val;
+        }
+        e->next = first;
+        if (__atomic_compare_exchange_n(head, &first, e, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+            epoch_exit(r);
+            return true;
+        }
+        // Lost the race, search the newly pushed entries as insert() does
+        checked = e->next;
+        STAT_ADD(spin_iterations, 1);
+    }
+}
+
+// Retrieves an entry from the hash table by key without taking any lock.
+// The entry itself is returned and stays valid until the caller leaves
+// its epoch section.
+static bucket_entry * retrieve(int key) {
+    bucket_entry *b = __atomic_load_n(&table[ht_hash(key) & (num_buckets - 1)],
+                                      __ATOMIC_ACQUIRE);
+    while (b != NULL) {
+        bucket_entry *next = __atomic_load_n(&b->next, __ATOMIC_ACQUIRE);
+        if (b->key == key && !is_marked(next)) return b;
+        b = unmarked(next);
+    }
+    return NULL;
+}
+
+// Copies the current value of key to *val_out without taking any lock
+static bool retrieve_into(int key, int *val_out) {
+    thread_epoch *r = epoch_enter();
+    bucket_entry *b = retrieve(key);
+    if (b != NULL) *val_out = __atomic_load_n(&b->val, __ATOMIC_RELAXED);
+    epoch_exit(r);
+    return b != NULL;
+}
+
+// Unlinks every removed entry from the chain at head, retiring the ones
+// this thread unlinked. Starts over whenever a CAS shows the chain moved.
+static void unlink_marked(thread_epoch *r, bucket_entry **head) {
+    bucket_entry **link, *cur, *next;
+retry:
+    link = head;
+    cur = __atomic_load_n(link, __ATOMIC_ACQUIRE);
+    while (cur != NULL) {
+        next = __atomic_load_n(&cur->next, __ATOMIC_ACQUIRE);
+        if (is_marked(next)) {
+            // Fails if link's owner was removed too, or head gained entries
+            if (!__atomic_compare_exchange_n(link, &cur, unmarked(next), 0,
+                                             __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+                goto retry;
+            }
+            retire(r, cur);
+            cur = unmarked(next);
+        } else {
+            link = &cur->next;
+            cur = next;
+        }
+    }
+}
+
+// Removes key from the table without taking any lock. Returns false if the
+// key wasn't in the table.
+static bool remove_key(int key) {
+    bucket_entry **head = &table[ht_hash(key) & (num_buckets - 1)];
+    thread_epoch *r = epoch_enter();
+    bool removed = false;
+    bucket_entry *b;
+
+    while ((b = retrieve(key)) != NULL) {
+        bucket_entry *next = __atomic_load_n(&b->next, __ATOMIC_ACQUIRE);
+        if (!is_marked(next) &&
+            __atomic_compare_exchange_n(&b->next, &next, marked(next), 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            removed = true;
+            break;
+        }
+        // Someone else removed it or unlinked its successor, look again
+    }
+    if (removed) unlink_marked(r, head);
+
+    epoch_exit(r);
+    return removed;
+}
+
+// Prefetches the bucket heads of a batch of keys
+static void prefetch_batch(const int *batch_keys, size_t n) {
+    size_t k;
+    for (k = 0; k < n; k++) {
+        __builtin_prefetch(&table[ht_hash(batch_keys[k]) & (num_buckets - 1)]);
+    }
+}
+
+// Inserts n key-value pairs. Each round prefetches the bucket heads of
+// BATCH_SIZE keys up front so their cache misses overlap.
+static void insert_batch(const int *batch_keys, const int *batch_vals, size_t n) {
+    size_t done, k;
+    for (done = 0; done < n; done += BATCH_SIZE) {
+        size_t count = n - done < BATCH_SIZE ? n - done : BATCH_SIZE;
+        prefetch_batch(batch_keys + done, count);
+        for (k = done; k < done + count; k++) {
+            insert(batch_keys[k], batch_vals[k]);
+        }
+    }
+}
+
+// Looks up n keys, see ht_backend. Each round of BATCH_SIZE keys runs in
+// one epoch section.
+static size_t retrieve_batch(const int *batch_keys, int *vals_out, bool *found, size_t n) {
+    size_t done, k, hits = 0;
+    for (done = 0; done < n; done += BATCH_SIZE) {
+        size_t count = n - done < BATCH_SIZE ? n - done : BATCH_SIZE;
+        prefetch_batch(batch_keys + done, count);
+        thread_epoch *r = epoch_enter();
+        for (k = done; k < done + count; k++) {
+            bucket_entry *b = retrieve(batch_keys[k]);
+            found[k] = b != NULL;
+            if (b != NULL) {
+                vals_out[k] = __atomic_load_n(&b->val, __ATOMIC_RELAXED);
+                hits++;
+            }
+        }
+        epoch_exit(r);
+    }
+    return hits;
+}
+
+// Sizes the fixed bucket array for cfg->expected_keys entries
+static void init(const ht_config *cfg) {
+    for (num_buckets = 1; num_buckets * MAX_LOAD < cfg->expected_keys; num_buckets <<= 1);
+    table = calloc(num_buckets, sizeof(bucket_entry *));
+    if (!table) {
+        panic("out of memory allocating hash table");
+    }
+    global_epoch = 0;
+    epoch_generation++;
+    pool_init();
+}
+
+// Memory footprint, see ht_mem_stats. Removed entries, whether still
+// marked in a chain, in limbo or on a free list, count as overhead.
+static void mem_stats(ht_mem_stats *out) {
+    thread_epoch *r;
+    long i, len;
+    bucket_entry *e;
+    memset(out, 0, sizeof(*out));
+    out->index_bytes = sizeof(bucket_entry *) * num_buckets;
+    out->overhead_bytes = ht_alloc_overhead(table, sizeof(bucket_entry *) * num_buckets);
+    for (r = all_epochs; r != NULL; r = r->next) {
+        out->index_bytes += sizeof(thread_epoch);
+        out->overhead_bytes += ht_alloc_overhead(r, sizeof(thread_epoch));
+    }
+    for (i = 0; i < num_buckets; i++) {
+        len = 0;
+        for (e = table[i]; e != NULL; e = unmarked(e->next)) {
+            if (!is_marked(e->next)) len++;
+        }
+        ht_count_chain(out, len);
+        out->keys += len;
+    }
+    out->entry_bytes = sizeof(bucket_entry) * out->keys;
+    pool_stats(out, out->keys);
+}
+
+// Frees every entry of the table at once, including retired ones
+static void destroy(void) {
+    free(table);
+    pool_free();
+    while (all_epochs != NULL) {
+        thread_epoch *next = all_epochs->next;
+        free(all_epochs);
+        all_epochs = next;
+    }
+}
+
+const ht_backend lockfree_backend = {
+    .name = "lockfree",
+    .init = init,
+    .insert = insert,
+    .retrieve_into = retrieve_into,
+    .insert_batch = insert_batch,
+    .retrieve_batch = retrieve_batch,
+    .remove = remove_key,
+    .upsert = upsert,
+    .mem_stats = mem_stats,
+    .destroy = destroy,
+};
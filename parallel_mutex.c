@@ -1,202 +1,114 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <pthread.h>
-#include <assert.h>
-#include <sys/time.h>
-
-#define NUM_BUCKETS 5     // Buckets in hash table
-#define NUM_KEYS 100000   // Number of keys inserted per thread
-int num_threads = 1;      // Number of threads (configurable)
-int keys[NUM_KEYS];
-
-// Mutex array for each bucket
-pthread_mutex_t bucket_mutexes[NUM_BUCKETS];
-
-typedef struct bucket_entry {
-    int key;
-    int val;
-    struct bucket_entry *next;
-} bucket_entry;
-
-bucket_entry *table[NUM_BUCKETS];
-
-void panic(char *msg) {
-    printf("%s\n", msg);
-    exit(1);
+// Striped chained table with ht_lock stripes, one backend per lock kind.
+//
+// Under lock elision (HT_LOCK_ELIDED) the per-stripe entry counts of
+// ht_template.h matter: inserts to different stripes never write a
+// shared counter, so their transactions don't conflict.
+#define HT_PREFIX tbl
+#define HT_POLICY HT_POLICY_STRIPE
+#include "ht_template.h"
+
+static void init_mutex(const ht_config *cfg) {
+    tbl_init_kind(cfg, HT_LOCK_PTHREAD);
 }
 
-double now() {
-    struct timeval tv;
-    gettimeofday(&tv, 0);
-    return tv.tv_sec + tv.tv_usec / 1000000.0;
+static void build_mutex(const ht_config *cfg, const int *keys, const int *vals, size_t n) {
+    tbl_build_kind(cfg, HT_LOCK_PTHREAD, keys, vals, n);
 }
 
-// Inserts a key-value pair into the table with mutex protection
-void insert(int key, int val) {
-    int i = key % NUM_BUCKETS;
-    pthread_mutex_lock(&bucket_mutexes[i]);
-    
-    // Check if key already exists
-    bucket_entry *current;
-    for (current = table[i]; current != NULL; current = current->next) {
-        if (current->key == key) {
-            current->val = val;  // Update existing value
-            pthread_mutex_unlock(&bucket_mutexes[i]);
-            return;
-        }
-    }
-    
-    // Key doesn't exist, create new entry
-    bucket_entry *e = (bucket_entry *) malloc(sizeof(bucket_entry));
-    if (!e) {
-        pthread_mutex_unlock(&bucket_mutexes[i]);
-        panic("No memory to allocate bucket!");
-    }
-    e->key = key;
-    e->val = val;
-    e->next = table[i];
-    table[i] = e;
-    
-    pthread_mutex_unlock(&bucket_mutexes[i]);
+static void init_mcs(const ht_config *cfg) {
+    tbl_init_kind(cfg, HT_LOCK_MCS);
 }
 
-// Retrieves an entry from the hash table by key with mutex protection
-bucket_entry * retrieve(int key) {
-    int i = key % NUM_BUCKETS;
-    pthread_mutex_lock(&bucket_mutexes[i]);
-    
-    bucket_entry *b;
-    for (b = table[i]; b != NULL; b = b->next) {
-        if (b->key == key) {
-            bucket_entry *result = malloc(sizeof(bucket_entry));
-            if (!result) {
-                pthread_mutex_unlock(&bucket_mutexes[i]);
-                panic("No memory to allocate result!");
-            }
-            // Return a copy of the entry to prevent race conditions
-            result->key = b->key;
-            result->val = b->val;
-            result->next = NULL;
-            pthread_mutex_unlock(&bucket_mutexes[i]);
-            return result;
-        }
-    }
-    
-    pthread_mutex_unlock(&bucket_mutexes[i]);
-    return NULL;
+static void build_mcs(const ht_config *cfg, const int *keys, const int *vals, size_t n) {
+    tbl_build_kind(cfg, HT_LOCK_MCS, keys, vals, n);
 }
 
-void * put_phase(void *arg) {
-    long tid = (long) arg;
-    int key = 0;
-    
-    // Each thread handles its portion of keys
-    for (key = tid; key < NUM_KEYS; key += num_threads) {
-        insert(keys[key], tid);
-    }
-    
-    pthread_exit(NULL);
+static void init_ticket(const ht_config *cfg) {
+    tbl_init_kind(cfg, HT_LOCK_TICKET);
 }
 
-void * get_phase(void *arg) {
-    long tid = (long) arg;
-    int key = 0;
-    long lost = 0;
-    
-    for (key = tid; key < NUM_KEYS; key += num_threads) {
-        bucket_entry *entry = retrieve(keys[key]);
-        if (entry == NULL) {
-            lost++;
-        } else {
-            free(entry);  // Free the copied entry
-        }
-    }
-    
-    printf("[thread %ld] %ld keys lost!\n", tid, lost);
-    pthread_exit((void *)lost);
+static void build_ticket(const ht_config *cfg, const int *keys, const int *vals, size_t n) {
+    tbl_build_kind(cfg, HT_LOCK_TICKET, keys, vals, n);
 }
 
-int main(int argc, char **argv) {
-    long i;
-    pthread_t *threads;
-    double start, end;
-
-    if (argc != 2) {
-        panic("usage: ./parallel_mutex <num_threads>");
-    }
-    if ((num_threads = atoi(argv[1])) <= 0) {
-        panic("must enter a valid number of threads to run");
-    }
-
-    // Initialize hash table and mutexes
-    memset(table, 0, sizeof(bucket_entry*) * NUM_BUCKETS);
-    for (i = 0; i < NUM_BUCKETS; i++) {
-        pthread_mutex_init(&bucket_mutexes[i], NULL);
-    }
-
-    // Initialize random keys
-    srandom(time(NULL));
-    for (i = 0; i < NUM_KEYS; i++) {
-        keys[i] = random();
-    }
-
-    threads = (pthread_t *) malloc(sizeof(pthread_t) * num_threads);
-    if (!threads) {
-        panic("out of memory allocating thread handles");
-    }
-
-    // Insert keys in parallel
-    start = now();
-    for (i = 0; i < num_threads; i++) {
-        pthread_create(&threads[i], NULL, put_phase, (void *)i);
-    }
-    
-    // Wait for all insertions to complete
-    for (i = 0; i < num_threads; i++) {
-        pthread_join(threads[i], NULL);
-    }
-    end = now();
-    
-    printf("[main] Inserted %d keys in %f seconds\n", NUM_KEYS, end - start);
-
-    // Reset the thread array
-    memset(threads, 0, sizeof(pthread_t) * num_threads);
-
-    // Retrieve keys in parallel
-    start = now();
-    for (i = 0; i < num_threads; i++) {
-        pthread_create(&threads[i], NULL, get_phase, (void *)i);
-    }
+static void init_adaptive(const ht_config *cfg) {
+    tbl_init_kind(cfg, HT_LOCK_ADAPTIVE);
+}
 
-    // Collect count of lost keys
-    long total_lost = 0;
-    long *lost_keys = (long *) malloc(sizeof(long) * num_threads);
-    for (i = 0; i < num_threads; i++) {
-        pthread_join(threads[i], (void **)&lost_keys[i]);
-        total_lost += lost_keys[i];
-    }
-    end = now();
-    
-    printf("[main] Retrieved %ld/%d keys in %f seconds\n", 
-           NUM_KEYS - total_lost, NUM_KEYS, end - start);
+static void build_adaptive(const ht_config *cfg, const int *keys, const int *vals, size_t n) {
+    tbl_build_kind(cfg, HT_LOCK_ADAPTIVE, keys, vals, n);
+}
 
-    // Cleanup
-    free(lost_keys);
-    free(threads);
-    
-    // Cleanup hash table
-    for (i = 0; i < NUM_BUCKETS; i++) {
-        pthread_mutex_lock(&bucket_mutexes[i]);
-        bucket_entry *current = table[i];
-        while (current != NULL) {
-            bucket_entry *next = current->next;
-            free(current);
-            current = next;
-        }
-        pthread_mutex_unlock(&bucket_mutexes[i]);
-        pthread_mutex_destroy(&bucket_mutexes[i]);
-    }
+static void init_elided(const ht_config *cfg) {
+    tbl_init_kind(cfg, HT_LOCK_ELIDED);
+}
 
-    return 0;
+static void build_elided(const ht_config *cfg, const int *keys, const int *vals, size_t n) {
+    tbl_build_kind(cfg, HT_LOCK_ELIDED, keys, vals, n);
 }
+
+const ht_backend mutex_backend = {
+    .name = "mutex",
+    .init = init_mutex,
+    .insert = tbl_insert,
+    .retrieve_into = tbl_retrieve_into,
+    .insert_batch = tbl_insert_batch,
+    .retrieve_batch = tbl_retrieve_batch,
+    .upsert = tbl_upsert,
+    .build = build_mutex,
+    .mem_stats = tbl_mem_stats,
+    .destroy = tbl_destroy,
+};
+
+// The same table with the other stripe lock kinds
+const ht_backend mcs_backend = {
+    .name = "mcs",
+    .init = init_mcs,
+    .insert = tbl_insert,
+    .retrieve_into = tbl_retrieve_into,
+    .insert_batch = tbl_insert_batch,
+    .retrieve_batch = tbl_retrieve_batch,
+    .upsert = tbl_upsert,
+    .build = build_mcs,
+    .mem_stats = tbl_mem_stats,
+    .destroy = tbl_destroy,
+};
+
+const ht_backend ticket_backend = {
+    .name = "ticket",
+    .init = init_ticket,
+    .insert = tbl_insert,
+    .retrieve_into = tbl_retrieve_into,
+    .insert_batch = tbl_insert_batch,
+    .retrieve_batch = tbl_retrieve_batch,
+    .upsert = tbl_upsert,
+    .build = build_ticket,
+    .mem_stats = tbl_mem_stats,
+    .destroy = tbl_destroy,
+};
+
+const ht_backend adaptive_backend = {
+    .name = "adaptive",
+    .init = init_adaptive,
+    .insert = tbl_insert,
+    .retrieve_into = tbl_retrieve_into,
+    .insert_batch = tbl_insert_batch,
+    .retrieve_batch = tbl_retrieve_batch,
+    .upsert = tbl_upsert,
+    .build = build_adaptive,
+    .mem_stats = tbl_mem_stats,
+    .destroy = tbl_destroy,
+};
+
+const ht_backend elided_backend = {
+    .name = "elided",
+    .init = init_elided,
+    .insert = tbl_insert,
+    .retrieve_into = tbl_retrieve_into,
+    .insert_batch = tbl_insert_batch,
+    .retrieve_batch = tbl_retrieve_batch,
+    .upsert = tbl_upsert,
+    .build = build_elided,
+    .mem_stats = tbl_mem_stats,
+    .destroy = tbl_destroy,
+};
@@ -0,0 +1,449 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hashtable.h"
+
+#define INITIAL_SLOTS 8   // Initial slots per segment
+#define MAX_LOAD_PERCENT 75 // Fill level that doubles a segment
+#define EMPTY_KEY INT_MIN // Marks a free slot
+#define BATCH_SIZE 64     // Keys per insert_batch/retrieve_batch round
+#define SNAPSHOT_MAGIC "HTPROBE1"
+
+// Open addressing with linear probing: key/value pairs sit inline in one
+// flat array per segment, so a probe walks consecutive cache lines instead
+// of chasing pointers.
+typedef struct slot {
+    int key;
+    int val;
+} slot;
+
+// The table is split into a power-of-two number of segments, picked by the
+// low bits of the key's hash. Each segment has its own mutex and grows on its own,
+// so a resize only ever blocks the threads working on that segment.
+typedef struct segment {
+    pthread_mutex_t mutex;
+    slot *slots;          // capacity slots, EMPTY_KEY marks a free one
+    long capacity;        // Always a power of two
+    long count;           // Occupied slots
+    int has_empty_key;    // EMPTY_KEY itself cannot be stored in a slot
+    int empty_key_val;
+    int mapped;           // slots points into the loaded image, not the heap
+} __attribute__((aligned(CACHE_LINE))) segment;
+
+static segment *segments;
+static int num_stripes;
+static int stripe_bits;   // log2(num_stripes)
+static void *image;       // Snapshot mapped by load(), NULL if none
+static size_t image_size;
+
+static segment * segment_for(unsigned h) {
+    return &segments[h & (num_stripes - 1)];
+}
+
+// Returns the slot holding key, whose hash is h, or the free slot where
+// it belongs. The low hash bits already chose the segment, so probing
+// starts from the bits above them. Most keys sit in their home slot;
+// longer runs go to the SIMD probe kernel.
+static slot * find_slot(slot *slots, long capacity, unsigned h, int key) {
+    long i = (h >> stripe_bits) & (capacity - 1);
+    if (slots[i].key == key || slots[i].key == EMPTY_KEY) return &slots[i];
+    return &slots[ht_probe((const int *) slots, capacity, i, key, EMPTY_KEY)];
+}
+
+static slot * alloc_slots(long capacity) {
+    long i;
+    slot *slots = malloc(sizeof(slot) * capacity);
+    if (!slots) return NULL;
+    for (i = 0; i < capacity; i++) {
+        slots[i].key = EMPTY_KEY;
+    }
+    return slots;
+}
+
+// Doubles a segment and reinserts its entries. Caller holds its mutex.
+static void grow_segment(segment *seg) {
+    long i;
+    long capacity = seg->capacity * 2;
+    slot *slots = alloc_slots(capacity);
+    if (!slots) {
+        pthread_mutex_unlock(&seg->mutex);
+        panic("No memory to grow segment!");
+    }
+    for (i = 0; i < seg->capacity; i++) {
+        if (seg->slots[i].key != EMPTY_KEY) {
+            int key = seg->slots[i].key;
+            *find_slot(slots, capacity, ht_hash(key), key) = seg->slots[i];
+        }
+    }
+    if (!seg->mapped) free(seg->slots);
+    seg->slots = slots;
+    seg->capacity = capacity;
+    seg->mapped = 0;
+}
+
+// Adds key or updates its value. Caller holds the segment's mutex.
+static void insert_locked(segment *seg, unsigned h, int key, int val) {
+    if (key == EMPTY_KEY) {
+        seg->has_empty_key = 1;
+        seg->empty_key_val = val;
+        return;
+    }
+
+    slot *s = find_slot(seg->slots, seg->capacity, h, key);
+    if (s->key == key) {
+        s->val = val;  // Update existing value
+    } else {
+        if ((seg->count + 1) * 100 > seg->capacity * MAX_LOAD_PERCENT) {
+            grow_segment(seg);
+            s = find_slot(seg->slots, seg->capacity, h, key);
+        }
+        s->key = key;
+        s->val = val;
+        seg->count++;
+    }
+}
+
+// Inserts a key-value pair into the table with mutex protection
+static void insert(int key, int val) {
+    unsigned h = ht_hash(key);
+    segment *seg = segment_for(h);
+    ht_mutex_lock(&seg->mutex);
+    insert_locked(seg, h, key, val);
+    pthread_mutex_unlock(&seg->mutex);
+}
+
+// Copies the value of key to *val_out. Caller holds the segment's mutex.
+static bool retrieve_locked(segment *seg, unsigned h, int key, int *val_out) {
+    if (key == EMPTY_KEY) {
+        if (seg->has_empty_key) *val_out = seg->empty_key_val;
+        return seg->has_empty_key;
+    }
+    slot *s = find_slot(seg->slots, seg->capacity, h, key);
+    if (s->key != key) return false;
+    *val_out = s->val;
+    return true;
+}
+
+// Looks up key and copies its value to *val_out under the mutex.
+// Allocates nothing; returns false if the key isn't in the table.
+static bool retrieve_into(int key, int *val_out) {
+    unsigned h = ht_hash(key);
+    segment *seg = segment_for(h);
+    ht_mutex_lock(&seg->mutex);
+    bool found = retrieve_locked(seg, h, key, val_out);
+    pthread_mutex_unlock(&seg->mutex);
+    return found;
+}
+
+// Applies fn to key's value, or inserts the key, under the segment mutex
+static bool upsert(int key, ht_update_fn fn, void *arg) {
+    unsigned h = ht_hash(key);
+    segment *seg = segment_for(h);
+    int val = 0;
+    ht_mutex_lock(&seg->mutex);
+    bool found = retrieve_locked(seg, h, key, &val);
+    bool store = fn(&val, found, arg);
+    if (store) insert_locked(seg, h, key, val);
+    pthread_mutex_unlock(&seg->mutex);
+    return store;
+}
+
+// Hashes a batch, prefetching each key's segment header, and groups it by
+// segment with ht_group_batch()
+static void prepare_batch(const int *batch_keys, int n, unsigned *hash, int *stripe,
+                          int *order) {
+    int i;
+    for (i = 0; i < n; i++) {
+        hash[i] = ht_hash(batch_keys[i]);
+        __builtin_prefetch(&segments[hash[i] & (num_stripes - 1)]);
+    }
+    ht_group_batch(hash, n, num_stripes, stripe, order);
+}
+
+// Prefetches the home slots of the keys at order[k..] that share segment
+// seg. Slots move when a segment grows, so this runs under its mutex.
+static void prefetch_group(segment *seg, const unsigned *hash, const int *stripe,
+                           const int *order, int k, int n) {
+    long mask = seg->capacity - 1;
+    int m = stripe[order[k]];
+    for (; k < n && stripe[order[k]] == m; k++) {
+        __builtin_prefetch(&seg->slots[(hash[order[k]] >> stripe_bits) & mask]);
+    }
+}
+
+// Inserts n key-value pairs, taking each segment's mutex once per
+// BATCH_SIZE keys instead of once per key
+static void insert_batch(const int *batch_keys, const int *batch_vals, size_t n) {
+    unsigned hash[BATCH_SIZE];
+    int stripe[BATCH_SIZE], order[BATCH_SIZE];
+    size_t done;
+    for (done = 0; done < n; done += BATCH_SIZE) {
+        int count = n - done < BATCH_SIZE ? n - done : BATCH_SIZE;
+        const int *ks = batch_keys + done, *vs = batch_vals + done;
+        int k = 0;
+        prepare_batch(ks, count, hash, stripe, order);
+        while (k < count) {
+            int m = stripe[order[k]];
+            segment *seg = &segments[m];
+            ht_mutex_lock(&seg->mutex);
+            prefetch_group(seg, hash, stripe, order, k, count);
+            for (; k < count && stripe[order[k]] == m; k++) {
+                insert_locked(seg, hash[order[k]], ks[order[k]], vs[order[k]]);
+            }
+            pthread_mutex_unlock(&seg->mutex);
+        }
+    }
+}
+
+// Looks up n keys, see ht_backend, taking each segment's mutex once per
+// BATCH_SIZE keys and prefetching the home slots under it
+static size_t retrieve_batch(const int *batch_keys, int *vals_out, bool *found, size_t n) {
+    unsigned hash[BATCH_SIZE];
+    int stripe[BATCH_SIZE], order[BATCH_SIZE];
+    size_t done, hits = 0;
+    for (done = 0; done < n; done += BATCH_SIZE) {
+        int count = n - done < BATCH_SIZE ? n - done : BATCH_SIZE;
+        const int *ks = batch_keys + done;
+        int k = 0;
+        prepare_batch(ks, count, hash, stripe, order);
+        while (k < count) {
+            int m = stripe[order[k]];
+            segment *seg = &segments[m];
+            ht_mutex_lock(&seg->mutex);
+            prefetch_group(seg, hash, stripe, order, k, count);
+            for (; k < count && stripe[order[k]] == m; k++) {
+                size_t pos = done + order[k];
+                found[pos] = retrieve_locked(seg, hash[order[k]], batch_keys[pos], &vals_out[pos]);
+                hits += found[pos];
+            }
+            pthread_mutex_unlock(&seg->mutex);
+        }
+    }
+    return hits;
+}
+
+// Allocates n segments with their mutexes but no slots yet
+static void alloc_segments(int n) {
+    int i;
+    num_stripes = n;
+    stripe_bits = 0;
+    while ((1 << stripe_bits) < num_stripes) stripe_bits++;
+    image = NULL;
+
+    segments = aligned_alloc(CACHE_LINE, sizeof(segment) * num_stripes);
+    if (!segments) {
+        panic("out of memory allocating segments");
+    }
+    for (i = 0; i < num_stripes; i++) {
+        pthread_mutex_init(&segments[i].mutex, NULL);
+        segments[i].mapped = 0;
+    }
+}
+
+// Sets up cfg->num_stripes empty segments
+static void init(const ht_config *cfg) {
+    int i;
+    alloc_segments(cfg->num_stripes);
+    for (i = 0; i < num_stripes; i++) {
+        segments[i].slots = alloc_slots(INITIAL_SLOTS);
+        if (!segments[i].slots) {
+            panic("out of memory allocating hash table");
+        }
+        segments[i].capacity = INITIAL_SLOTS;
+        segments[i].count = 0;
+        segments[i].has_empty_key = 0;
+    }
+}
+
+// Snapshot file: a header, one record per segment, then every segment's
+// slot array at a cache-line-aligned byte offset. Only offsets are
+// stored, so the image is position independent and load() can map it and
+// use the slot arrays in place. Segments and home slots come from the
+// hash, so the file records which one it was built with. Integers are in
+// the byte order of the machine that wrote them.
+typedef struct snapshot_header {
+    char magic[8];        // SNAPSHOT_MAGIC
+    char hash[16];        // HT_HASH_NAME of the writer
+    long num_stripes;
+} snapshot_header;
+
+typedef struct snapshot_segment {
+    long capacity;
+    long count;
+    long offset;          // File offset of the slot array
+    int has_empty_key;
+    int empty_key_val;
+} snapshot_segment;
+
+static long align_up(long n) {
+    return (n + CACHE_LINE - 1) & ~(long) (CACHE_LINE - 1);
+}
+
+// Writes the table to path. Each segment is copied under its mutex, so
+// the snapshot is only consistent as a whole if no inserts run meanwhile.
+static void save(const char *path) {
+    snapshot_header h;
+    snapshot_segment rec;
+    long offset;
+    int i;
+    FILE *f = fopen(path, "wb");
+    if (!f) panic("cannot create snapshot file");
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+    strncpy(h.hash, HT_HASH_NAME, sizeof(h.hash) - 1);
+    h.num_stripes = num_stripes;
+    fwrite(&h, sizeof(h), 1, f);
+
+    // Every segment stays locked from its record until its slots are
+    // written, so a concurrent grow cannot make the two disagree
+    offset = align_up(sizeof(h) + sizeof(snapshot_segment) * num_stripes);
+    for (i = 0; i < num_stripes; i++) {
+        segment *seg = &segments[i];
+        ht_mutex_lock(&seg->mutex);
+        memset(&rec, 0, sizeof(rec));
+        rec.capacity = seg->capacity;
+        rec.count = seg->count;
+        rec.offset = offset;
+        rec.has_empty_key = seg->has_empty_key;
+        rec.empty_key_val = seg->empty_key_val;
+        fwrite(&rec, sizeof(rec), 1, f);
+        offset = align_up(offset + sizeof(slot) * seg->capacity);
+    }
+    for (i = 0; i < num_stripes; i++) {
+        segment *seg = &segments[i];
+        if (fseek(f, align_up(ftell(f)), SEEK_SET) != 0 ||
+            fwrite(seg->slots, sizeof(slot), seg->capacity, f) != (size_t) seg->capacity) {
+            fclose(f);
+            panic("cannot write snapshot file");
+        }
+        pthread_mutex_unlock(&seg->mutex);
+    }
+    if (fclose(f) != 0) panic("cannot write snapshot file");
+}
+
+// Occupied slots of a mapped segment's slot array
+static long count_occupied(const slot *slots, long capacity) {
+    long i, n = 0;
+    for (i = 0; i < capacity; i++) {
+        n += slots[i].key != EMPTY_KEY;
+    }
+    return n;
+}
+
+// Sets the table up from a snapshot written by save() instead of from
+// scratch. The file is mapped copy-on-write and the segments use its slot
+// arrays directly, so nothing is inserted or allocated per key, and a
+// segment that later grows moves to the heap like any other. The stripe
+// count comes from the file. Each segment's slots are counted once, which
+// reads every page in, so that a file whose slots don't match its counts
+// can't leave a segment with no free slot to end a probe.
+static void load(const ht_config *cfg, const char *path) {
+    struct stat st;
+    const snapshot_header *h;
+    const snapshot_segment *recs;
+    int fd, i;
+    (void) cfg;           // The stripe count comes from the file
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) panic("cannot open snapshot file");
+    if ((size_t) st.st_size < sizeof(snapshot_header)) panic("snapshot file is truncated");
+    image_size = st.st_size;
+    void *base = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) panic("cannot map snapshot file");
+
+    h = base;
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0) {
+        panic("not a probe table snapshot");
+    }
+    if (strncmp(h->hash, HT_HASH_NAME, sizeof(h->hash)) != 0) {
+        panic("snapshot was written with a different hash function");
+    }
+    if (h->num_stripes <= 0 || (h->num_stripes & (h->num_stripes - 1)) != 0 ||
+        (size_t) h->num_stripes > (image_size - sizeof(*h)) / sizeof(*recs)) {
+        panic("snapshot file is corrupt");
+    }
+
+    alloc_segments(h->num_stripes);
+    image = base;
+    recs = (const snapshot_segment *) (h + 1);
+    for (i = 0; i < num_stripes; i++) {
+        const snapshot_segment *r = &recs[i];
+        // Sizes are checked by division, as a corrupt one could make a
+        // product wrap past image_size
+        if (r->capacity <= 0 || (r->capacity & (r->capacity - 1)) != 0 ||
+            r->offset < 0 || (r->offset & (CACHE_LINE - 1)) != 0 ||
+            (size_t) r->offset > image_size ||
+            (size_t) r->capacity > (image_size - r->offset) / sizeof(slot)) {
+            panic("snapshot file is corrupt");
+        }
+        slot *slots = (slot *) ((char *) base + r->offset);
+        if (count_occupied(slots, r->capacity) != r->count ||
+            r->count * 100 > r->capacity * MAX_LOAD_PERCENT) {
+            panic("snapshot file is corrupt");
+        }
+        segments[i].slots = slots;
+        segments[i].capacity = r->capacity;
+        segments[i].count = r->count;
+        segments[i].has_empty_key = r->has_empty_key;
+        segments[i].empty_key_val = r->empty_key_val;
+        segments[i].mapped = 1;
+    }
+}
+
+// Memory footprint, see ht_mem_stats. Free slots are overhead, and keys
+// are counted by how far past their home slot they sit. Slot arrays of a
+// loaded snapshot are file pages, with no allocator overhead.
+static void mem_stats(ht_mem_stats *out) {
+    int i;
+    long j;
+    memset(out, 0, sizeof(*out));
+    out->index_bytes = sizeof(segment) * num_stripes;
+    out->overhead_bytes = ht_alloc_overhead(segments, sizeof(segment) * num_stripes);
+    for (i = 0; i < num_stripes; i++) {
+        segment *seg = &segments[i];
+        out->keys += seg->count + seg->has_empty_key;
+        out->entry_bytes += sizeof(slot) * seg->count;
+        out->overhead_bytes += sizeof(slot) * (seg->capacity - seg->count);
+        if (!seg->mapped) {
+            out->overhead_bytes += ht_alloc_overhead(seg->slots, sizeof(slot) * seg->capacity);
+        }
+        for (j = 0; j < seg->capacity; j++) {
+            if (seg->slots[j].key == EMPTY_KEY) continue;
+            long home = (ht_hash(seg->slots[j].key) >> stripe_bits) & (seg->capacity - 1);
+            ht_count_chain(out, (j - home) & (seg->capacity - 1));
+        }
+    }
+}
+
+static void destroy(void) {
+    int i;
+    for (i = 0; i < num_stripes; i++) {
+        if (!segments[i].mapped) free(segments[i].slots);
+        pthread_mutex_destroy(&segments[i].mutex);
+    }
+    free(segments);
+    if (image != NULL) munmap(image, image_size);
+}
+
+const ht_backend probe_backend = {
+    .name = "probe",
+    .init = init,
+    .insert = insert,
+    .retrieve_into = retrieve_into,
+    .insert_batch = insert_batch,
+    .retrieve_batch = retrieve_batch,
+    .upsert = upsert,
+    .save = save,
+    .load = load,
+    .mem_stats = mem_stats,
+    .destroy = destroy,
+};
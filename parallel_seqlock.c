@@ -0,0 +1,464 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "hashtable.h"
+
+#define NUM_BUCKETS 8     // Initial buckets in hash table, a power of two
+#define MAX_LOAD 2        // Average chain length that triggers a resize
+#define MIGRATE_STEP 2    // Old buckets moved per insert while resizing
+#define BATCH_SIZE 64     // Keys per insert_batch/retrieve_batch round
+#define READ_RETRIES 4    // Optimistic attempts before a reader takes the mutex
+
+// Writers serialize on a mutex per stripe as in parallel_mutex.c, and bump
+// the stripe's sequence number to odd before changing anything it guards
+// and back to even afterwards. Readers take no lock and write nothing
+// shared: they note the sequence, walk the chain, and retry if the
+// sequence was odd or has moved on since.
+typedef struct lock_stripe {
+    pthread_mutex_t mutex;
+    unsigned long seq;    // Odd while a writer is changing the stripe
+    long migrate_cursor;  // Next old bucket this stripe moves while resizing
+} __attribute__((aligned(CACHE_LINE))) lock_stripe;
+
+static lock_stripe *bucket_locks;
+static int num_stripes;
+
+// Anything a reader touches may be rewritten under it, so entry fields and
+// bucket heads are accessed with relaxed atomics. The table pointers are
+// published with release so a reader never sees an array before its size.
+typedef struct bucket_entry {
+    int key;
+    int val;
+    struct bucket_entry *next;
+} bucket_entry;
+
+// A bucket array carries its own size, so one pointer load always gives a
+// reader an index range that matches the array it indexes. Outgrown arrays
+// stay allocated until destroy(), since a reader may still be walking one.
+typedef struct bucket_array {
+    long size;
+    struct bucket_array *prev;  // Previously outgrown array, for destroy()
+    bucket_entry *buckets[];
+} bucket_array;
+
+// Entries come from ht_slab.h and are never freed before destroy(), so a
+// reader can always follow a pointer
+#define SLAB_PREFIX pool
+#define SLAB_ENTRY bucket_entry
+#include "ht_slab.h"
+
+// The table layout below only changes with every mutex held
+static bucket_array *table;           // Current buckets
+static bucket_array *old_table;       // Buckets being rehashed, NULL when not resizing
+static int locks_pending;             // Locks with old buckets left to move
+static long num_entries;              // Entries in the table
+static int resizing;                  // Set while a resize is in progress
+
+static bucket_array * alloc_array(long size) {
+    bucket_array *a = calloc(1, sizeof(bucket_array) + size * sizeof(bucket_entry *));
+    if (a) a->size = size;
+    return a;
+}
+
+// Marks stripe m as being written. Caller holds its mutex.
+static void write_begin(int m) {
+    lock_stripe *s = &bucket_locks[m];
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(int m) {
+    lock_stripe *s = &bucket_locks[m];
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void lock_all_buckets() {
+    int m;
+    for (m = 0; m < num_stripes; m++) {
+        ht_mutex_lock(&bucket_locks[m].mutex);
+        write_begin(m);
+    }
+}
+
+static void unlock_all_buckets() {
+    int m;
+    for (m = num_stripes - 1; m >= 0; m--) {
+        write_end(m);
+        pthread_mutex_unlock(&bucket_locks[m].mutex);
+    }
+}
+
+// Moves every entry of old bucket j into the current table
+static void migrate_bucket(long j) {
+    bucket_entry *e = old_table->buckets[j];
+    while (e != NULL) {
+        bucket_entry *next = e->next;
+        bucket_entry **head = &table->buckets[ht_hash(e->key) & (table->size - 1)];
+        __atomic_store_n(&e->next, *head, __ATOMIC_RELAXED);
+        __atomic_store_n(head, e, __ATOMIC_RELAXED);
+        e = next;
+    }
+    __atomic_store_n(&old_table->buckets[j], NULL, __ATOMIC_RELAXED);
+}
+
+// Moves the next few old buckets guarded by stripe m, which the caller
+// holds inside write_begin/write_end. Returns 1 if that emptied the last
+// old bucket of the whole table. The cursor is stored atomically so
+// help_resize() can skip finished stripes without their mutex.
+static int migrate_step(int m) {
+    lock_stripe *s = &bucket_locks[m];
+    long cursor = s->migrate_cursor;
+    int n;
+    if (old_table == NULL || cursor >= old_table->size) return 0;
+    for (n = 0; n < MIGRATE_STEP && cursor < old_table->size; n++) {
+        migrate_bucket(cursor);
+        cursor += num_stripes;
+    }
+    __atomic_store_n(&s->migrate_cursor, cursor, __ATOMIC_RELAXED);
+    return cursor >= old_table->size &&
+           __atomic_sub_fetch(&locks_pending, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+// Returns 1 if stripe m has no old buckets left to move. Outgrown arrays
+// stay allocated until destroy(), so reading old->size is safe.
+static int stripe_migrated(int m) {
+    bucket_array *old = __atomic_load_n(&old_table, __ATOMIC_ACQUIRE);
+    return old == NULL ||
+           __atomic_load_n(&bucket_locks[m].migrate_cursor, __ATOMIC_RELAXED) >= old->size;
+}
+
+// Doubles the table. Only the pointer swap happens with every mutex held;
+// entries are moved over a few buckets at a time by later inserts.
+static void start_resize() {
+    int expected = 0;
+    if (!__atomic_compare_exchange_n(&resizing, &expected, 1, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;  // Another thread is already resizing
+    }
+    if (__atomic_load_n(&num_entries, __ATOMIC_RELAXED) <= table->size * MAX_LOAD) {
+        __atomic_store_n(&resizing, 0, __ATOMIC_RELEASE);
+        return;
+    }
+
+    bucket_array *new_table = alloc_array(table->size * 2);
+    if (!new_table) panic("No memory to grow table!");
+
+    lock_all_buckets();
+    new_table->prev = table;
+    __atomic_store_n(&old_table, table, __ATOMIC_RELEASE);
+    __atomic_store_n(&table, new_table, __ATOMIC_RELEASE);
+    for (int m = 0; m < num_stripes; m++) {
+        __atomic_store_n(&bucket_locks[m].migrate_cursor, m, __ATOMIC_RELAXED);
+    }
+    locks_pending = num_stripes;
+    unlock_all_buckets();
+}
+
+// Retires the old buckets once all of them have been moved. The array
+// itself stays on the prev list until destroy().
+static void finish_resize() {
+    lock_all_buckets();
+    __atomic_store_n(&old_table, NULL, __ATOMIC_RELAXED);
+    unlock_all_buckets();
+    __atomic_store_n(&resizing, 0, __ATOMIC_RELEASE);
+}
+
+// Moves one step of the first unfinished stripe at or after m. Called
+// with no mutex held, so a resize completes even when every insert lands
+// in stripes that are already migrated, as in ht_template.h.
+static void help_resize(int m) {
+    int k;
+    if (!__atomic_load_n(&resizing, __ATOMIC_ACQUIRE)) return;
+    for (k = 0; k < num_stripes; k++) {
+        int o = (m + k) & (num_stripes - 1);
+        int last;
+        if (stripe_migrated(o)) continue;
+        ht_mutex_lock(&bucket_locks[o].mutex);
+        write_begin(o);
+        last = migrate_step(o);
+        write_end(o);
+        pthread_mutex_unlock(&bucket_locks[o].mutex);
+        if (last) finish_resize();
+        return;
+    }
+}
+
+// Runs after a write to stripe m has dropped its mutex. A writer whose
+// own stripe is done (or that just asked to grow) helps another stripe
+// along, so the resize cannot stall on stripes nobody writes to.
+static void end_write(int m, int migrated_last, int grow) {
+    if (migrated_last) {
+        finish_resize();
+    } else if (__atomic_load_n(&resizing, __ATOMIC_ACQUIRE) &&
+               (grow || stripe_migrated(m))) {
+        help_resize(m);
+    }
+    if (grow) start_resize();
+}
+
+static bucket_entry * find_in(bucket_array *a, unsigned h, int key) {
+    bucket_entry *b = __atomic_load_n(&a->buckets[h & (a->size - 1)], __ATOMIC_RELAXED);
+    for (; b != NULL; b = __atomic_load_n(&b->next, __ATOMIC_RELAXED)) {
+        if (__atomic_load_n(&b->key, __ATOMIC_RELAXED) == key) return b;
+    }
+    return NULL;
+}
+
+// Finds key in the current table or its not yet migrated old bucket.
+// Safe without the mutex, but the answer only counts if the stripe's
+// sequence did not move meanwhile.
+static bucket_entry * find_entry(unsigned h, int key) {
+    bucket_entry *b = find_in(__atomic_load_n(&table, __ATOMIC_ACQUIRE), h, key);
+    if (b == NULL) {
+        bucket_array *old = __atomic_load_n(&old_table, __ATOMIC_ACQUIRE);
+        if (old != NULL) b = find_in(old, h, key);
+    }
+    return b;
+}
+
+// Adds key or updates its value. Caller holds stripe m inside
+// write_begin/write_end; it is released before panicking. Returns 1 if
+// the table has outgrown its load factor.
+static int insert_locked(int m, unsigned h, int key, int val) {
+    // Check if key already exists
+    bucket_entry *e = find_entry(h, key);
+    if (e != NULL) {
+        __atomic_store_n(&e->val, val, __ATOMIC_RELAXED);  // Update existing value
+        return 0;
+    }
+
+    // Key doesn't exist, create new entry
+    e = pool_alloc();
+    if (!e) {
+        write_end(m);
+        pthread_mutex_unlock(&bucket_locks[m].mutex);
+        panic("No memory to allocate bucket!");
+    }
+    bucket_entry **head = &table->buckets[h & (table->size - 1)];
+    __atomic_store_n(&e->key, key, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->val, val, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->next, *head, __ATOMIC_RELAXED);
+    __atomic_store_n(head, e, __ATOMIC_RELAXED);
+    return __atomic_add_fetch(&num_entries, 1, __ATOMIC_RELAXED) > table->size * MAX_LOAD;
+}
+
+// Inserts a key-value pair into the table with mutex protection
+static void insert(int key, int val) {
+    unsigned h = ht_hash(key);
+    int m = h & (num_stripes - 1);
+    ht_mutex_lock(&bucket_locks[m].mutex);
+    write_begin(m);
+    int migrated_last = migrate_step(m);
+    int grow = insert_locked(m, h, key, val);
+    write_end(m);
+    pthread_mutex_unlock(&bucket_locks[m].mutex);
+    end_write(m, migrated_last, grow);
+}
+
+// Looks up key under the sequence counter of stripe m without writing to
+// shared memory. Returns 1 and sets *found if no writer interfered.
+static int try_read(int m, unsigned h, int key, int *val_out, bool *found) {
+    lock_stripe *s = &bucket_locks[m];
+    unsigned long seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) return 0;
+
+    bucket_entry *b = find_entry(h, key);
+    int val = b != NULL ? __atomic_load_n(&b->val, __ATOMIC_RELAXED) : 0;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq) return 0;
+    if (b != NULL) *val_out = val;
+    *found = b != NULL;
+    return 1;
+}
+
+// Looks up key, whose hash is h, and copies its value to *val_out,
+// optimistically first and under the mutex if writers keep interfering.
+// Allocates nothing; returns false if the key isn't in the table.
+static bool lookup(unsigned h, int key, int *val_out) {
+    int m = h & (num_stripes - 1);
+    bool found;
+    int tries;
+    for (tries = 0; tries < READ_RETRIES; tries++) {
+        if (try_read(m, h, key, val_out, &found)) return found;
+        STAT_ADD(spin_iterations, 1);
+    }
+
+    ht_mutex_lock(&bucket_locks[m].mutex);
+    bucket_entry *b = find_entry(h, key);
+    if (b != NULL) {
+        *val_out = b->val;
+    }
+    pthread_mutex_unlock(&bucket_locks[m].mutex);
+    return b != NULL;
+}
+
+static bool retrieve_into(int key, int *val_out) {
+    return lookup(ht_hash(key), key, val_out);
+}
+
+// Applies fn to key's value, or inserts the key, as one write section
+// under the stripe mutex
+static bool upsert(int key, ht_update_fn fn, void *arg) {
+    unsigned h = ht_hash(key);
+    int m = h & (num_stripes - 1);
+    int grow = 0;
+    ht_mutex_lock(&bucket_locks[m].mutex);
+    write_begin(m);
+    int migrated_last = migrate_step(m);
+    bucket_entry *e = find_entry(h, key);
+    int val = e != NULL ? e->val : 0;
+    bool store = fn(&val, e != NULL, arg);
+    if (store && e != NULL) {
+        __atomic_store_n(&e->val, val, __ATOMIC_RELAXED);
+    } else if (store) {
+        grow = insert_locked(m, h, key, val);
+    }
+    write_end(m);
+    pthread_mutex_unlock(&bucket_locks[m].mutex);
+    end_write(m, migrated_last, grow);
+    return store;
+}
+
+// Hashes a batch, prefetching each key's stripe and bucket head, and
+// groups it by stripe with ht_group_batch(). The table may be resized
+// meanwhile, which only wastes a prefetch.
+static void prepare_batch(const int *batch_keys, int n, unsigned *hash, int *stripe,
+                          int *order) {
+    bucket_array *a = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+    int i;
+    for (i = 0; i < n; i++) {
+        hash[i] = ht_hash(batch_keys[i]);
+        __builtin_prefetch(&bucket_locks[hash[i] & (num_stripes - 1)]);
+        __builtin_prefetch(&a->buckets[hash[i] & (a->size - 1)]);
+    }
+    ht_group_batch(hash, n, num_stripes, stripe, order);
+}
+
+// Inserts n key-value pairs, taking each stripe's mutex once per
+// BATCH_SIZE keys instead of once per key
+static void insert_batch(const int *batch_keys, const int *batch_vals, size_t n) {
+    unsigned hash[BATCH_SIZE];
+    int stripe[BATCH_SIZE], order[BATCH_SIZE];
+    size_t done;
+    for (done = 0; done < n; done += BATCH_SIZE) {
+        int count = n - done < BATCH_SIZE ? n - done : BATCH_SIZE;
+        const int *ks = batch_keys + done, *vs = batch_vals + done;
+        int k = 0;
+        prepare_batch(ks, count, hash, stripe, order);
+        while (k < count) {
+            int m = stripe[order[k]];
+            int grow = 0;
+            ht_mutex_lock(&bucket_locks[m].mutex);
+            write_begin(m);
+            int migrated_last = migrate_step(m);
+            for (; k < count && stripe[order[k]] == m; k++) {
+                grow |= insert_locked(m, hash[order[k]], ks[order[k]], vs[order[k]]);
+            }
+            write_end(m);
+            pthread_mutex_unlock(&bucket_locks[m].mutex);
+            end_write(m, migrated_last, grow);
+        }
+    }
+}
+
+// Looks up n keys, see ht_backend. Readers take no lock, so the batch
+// only prefetches the bucket heads before the lookups.
+static size_t retrieve_batch(const int *batch_keys, int *vals_out, bool *found, size_t n) {
+    bucket_array *a;
+    unsigned hash[BATCH_SIZE];
+    size_t done, k, hits = 0;
+    for (done = 0; done < n; done += BATCH_SIZE) {
+        size_t count = n - done < BATCH_SIZE ? n - done : BATCH_SIZE;
+        a = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+        for (k = 0; k < count; k++) {
+            hash[k] = ht_hash(batch_keys[done + k]);
+            __builtin_prefetch(&a->buckets[hash[k] & (a->size - 1)]);
+        }
+        for (k = done; k < done + count; k++) {
+            found[k] = lookup(hash[k - done], batch_keys[k], &vals_out[k]);
+            hits += found[k];
+        }
+    }
+    return hits;
+}
+
+// Sets up an empty table with cfg->num_stripes mutex stripes
+static void init(const ht_config *cfg) {
+    int i;
+    num_stripes = cfg->num_stripes;
+    table = alloc_array(NUM_BUCKETS > num_stripes ? NUM_BUCKETS : num_stripes);
+    if (!table) {
+        panic("out of memory allocating hash table");
+    }
+    old_table = NULL;
+    num_entries = 0;
+    resizing = 0;
+    pool_init();
+
+    bucket_locks = aligned_alloc(CACHE_LINE, sizeof(lock_stripe) * num_stripes);
+    if (!bucket_locks) {
+        panic("out of memory allocating lock stripes");
+    }
+    for (i = 0; i < num_stripes; i++) {
+        pthread_mutex_init(&bucket_locks[i].mutex, NULL);
+        bucket_locks[i].seq = 0;
+    }
+}
+
+// Counts the chains of bucket array a into out, adding their entries to
+// out->keys
+static void chain_stats(ht_mem_stats *out, bucket_array *a) {
+    long i, len;
+    bucket_entry *e;
+    for (i = 0; i < a->size; i++) {
+        for (len = 0, e = a->buckets[i]; e != NULL; e = e->next) len++;
+        ht_count_chain(out, len);
+        out->keys += len;
+    }
+}
+
+// Memory footprint, see ht_mem_stats. Outgrown bucket arrays stay
+// allocated until destroy(), so they count towards index_bytes.
+static void mem_stats(ht_mem_stats *out) {
+    bucket_array *a;
+    memset(out, 0, sizeof(*out));
+    out->index_bytes = sizeof(lock_stripe) * num_stripes;
+    out->overhead_bytes = ht_alloc_overhead(bucket_locks, sizeof(lock_stripe) * num_stripes);
+    for (a = table; a != NULL; a = a->prev) {
+        size_t bytes = sizeof(bucket_array) + sizeof(bucket_entry *) * a->size;
+        out->index_bytes += bytes;
+        out->overhead_bytes += ht_alloc_overhead(a, bytes);
+    }
+    chain_stats(out, table);
+    if (old_table != NULL) chain_stats(out, old_table);
+    out->entry_bytes = sizeof(bucket_entry) * out->keys;
+    pool_stats(out, out->keys);
+}
+
+static void destroy(void) {
+    int i;
+    while (table != NULL) {
+        bucket_array *prev = table->prev;
+        free(table);
+        table = prev;
+    }
+    pool_free();
+    for (i = 0; i < num_stripes; i++) {
+        pthread_mutex_destroy(&bucket_locks[i].mutex);
+    }
+    free(bucket_locks);
+}
+
+const ht_backend seqlock_backend = {
+    .name = "seqlock",
+    .init = init,
+    .insert = insert,
+    .retrieve_into = retrieve_into,
+    .insert_batch = insert_batch,
+    .retrieve_batch = retrieve_batch,
+    .upsert = upsert,
+    .mem_stats = mem_stats,
+    .destroy = destroy,
+};
@@ -0,0 +1,463 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "hashtable.h"
+
+#define INITIAL_SLOTS 8   // Initial slots per shard
+#define MAX_LOAD_PERCENT 75 // Fill level that doubles a shard
+#define EMPTY_KEY INT_MIN // Marks a free slot
+#define RING_SIZE 256     // Requests per ring, a power of two
+#define CLIENTS_PER_THREAD 2  // Client slots per configured thread
+
+// Shared-nothing table: every shard is a private open-addressing table
+// owned by one server thread, which applies requests to it without any
+// lock. Callers never touch a shard; they post requests into a
+// single-producer/single-consumer ring per (client, shard) pair and the
+// owner drains its rings in order.
+//
+// The owners are threads of their own, one per configured thread, rather
+// than the workers themselves. ht_backend gives a worker no point at
+// which to serve its shard between operations, and a worker blocked on a
+// lookup, or done with its part of a phase, would stall every client of
+// its shard. The cost is that a -t N run has 2N runnable threads: the
+// owners yield whenever their rings are empty, but without 2N cores a
+// lookup's round trip can pay for a context switch to the owner and
+// back, so results on smaller machines understate the design.
+//
+// Inserts are posted and not waited for. A client's own later requests
+// to the same shard are applied after them, and a client thread drains
+// its rings in flush() and before it exits, so every insert is visible to
+// anyone who synchronizes with the inserting thread after that. Lookups
+// wait until the owner has written the result back, and so do upserts,
+// whose update function the owner runs on the shard.
+//
+// A table has CLIENTS_PER_THREAD client slots per configured thread. A
+// thread claims one on first use and hands it back when it exits. Threads
+// that find every slot taken share one more, overflow slot under a mutex
+// and wait for each of their requests to be applied, so they run
+// correctly rather than fast, and no longer without locks; the first
+// thread to need it says so on stderr.
+enum { REQ_INSERT, REQ_LOOKUP, REQ_UPSERT };
+
+typedef struct request {
+    int op;
+    unsigned hash;        // ht_hash(key), computed once by the client
+    int key;
+    int val;
+    int *val_out;         // Lookup results are written here by the owner
+    bool *found_out;      // As is whether an upsert stored a value
+    ht_update_fn fn;      // Upsert step and its argument
+    void *arg;
+} request;
+
+typedef struct ring {
+    unsigned long tail __attribute__((aligned(CACHE_LINE)));  // Next slot the client fills
+    unsigned long head __attribute__((aligned(CACHE_LINE)));  // Next slot the owner applies
+    request slots[RING_SIZE];
+} ring;
+
+typedef struct slot {
+    int key;
+    int val;
+} slot;
+
+typedef struct shard {
+    slot *slots;          // capacity slots, EMPTY_KEY marks a free one
+    long capacity;        // Always a power of two
+    long count;           // Occupied slots
+    int has_empty_key;    // EMPTY_KEY itself cannot be stored in a slot
+    int empty_key_val;
+    pthread_t owner;
+} __attribute__((aligned(CACHE_LINE))) shard;
+
+static shard *shards;
+static int num_shards;
+static ring *rings;       // rings[client * num_shards + shard]
+static int num_clients;   // Client slots, the last of them the overflow slot
+static int *client_used;  // Client slots currently held by a thread
+static pthread_mutex_t overflow_mutex;  // Held by the thread using the overflow slot
+static int overflow_reported;  // Set once a thread has had to use it
+static int stop;          // Tells the owners to exit
+static const int *owner_cpus;  // CPU of each owner, NULL when unpinned
+
+static __thread int my_client;       // The calling thread's client slot,
+static __thread unsigned my_client_generation;  // if this is client_generation
+static unsigned client_generation;   // Bumped by every init()
+static pthread_key_t client_key;     // Releases the slot at thread exit
+
+// num_shards need not be a power of two, so the hash is scaled into
+// range by a multiply and shift rather than divided
+static int shard_of(unsigned h) {
+    return ((unsigned long) h * num_shards) >> 32;
+}
+
+// Returns the slot holding key, whose hash is h, or the free slot where
+// it belongs. The top hash bits already chose the shard, so probing
+// starts from the low ones. Runs past the home slot go to the SIMD probe
+// kernel.
+static slot * find_slot(slot *slots, long capacity, unsigned h, int key) {
+    long i = h & (capacity - 1);
+    if (slots[i].key == key || slots[i].key == EMPTY_KEY) return &slots[i];
+    return &slots[ht_probe((const int *) slots, capacity, i, key, EMPTY_KEY)];
+}
+
+static slot * alloc_slots(long capacity) {
+    long i;
+    slot *slots = malloc(sizeof(slot) * capacity);
+    if (!slots) return NULL;
+    for (i = 0; i < capacity; i++) {
+        slots[i].key = EMPTY_KEY;
+    }
+    return slots;
+}
+
+// Doubles a shard and reinserts its entries. Runs on the owner.
+static void grow_shard(shard *sh) {
+    long i;
+    long capacity = sh->capacity * 2;
+    slot *slots = alloc_slots(capacity);
+    if (!slots) panic("No memory to grow shard!");
+    for (i = 0; i < sh->capacity; i++) {
+        if (sh->slots[i].key != EMPTY_KEY) {
+            int key = sh->slots[i].key;
+            *find_slot(slots, capacity, ht_hash(key), key) = sh->slots[i];
+        }
+    }
+    free(sh->slots);
+    sh->slots = slots;
+    sh->capacity = capacity;
+}
+
+static void shard_insert(shard *sh, unsigned h, int key, int val) {
+    if (key == EMPTY_KEY) {
+        sh->has_empty_key = 1;
+        sh->empty_key_val = val;
+        return;
+    }
+
+    slot *s = find_slot(sh->slots, sh->capacity, h, key);
+    if (s->key == key) {
+        s->val = val;  // Update existing value
+    } else {
+        if ((sh->count + 1) * 100 > sh->capacity * MAX_LOAD_PERCENT) {
+            grow_shard(sh);
+            s = find_slot(sh->slots, sh->capacity, h, key);
+        }
+        s->key = key;
+        s->val = val;
+        sh->count++;
+    }
+}
+
+static bool shard_lookup(shard *sh, unsigned h, int key, int *val_out) {
+    if (key == EMPTY_KEY) {
+        if (sh->has_empty_key) *val_out = sh->empty_key_val;
+        return sh->has_empty_key;
+    }
+    slot *s = find_slot(sh->slots, sh->capacity, h, key);
+    if (s->key != key) return false;
+    *val_out = s->val;
+    return true;
+}
+
+static bool shard_upsert(shard *sh, unsigned h, int key, ht_update_fn fn, void *arg) {
+    int val = 0;
+    bool found = shard_lookup(sh, h, key, &val);
+    if (!fn(&val, found, arg)) return false;
+    shard_insert(sh, h, key, val);
+    return true;
+}
+
+// Applies every request posted to one shard until destroy() sets stop,
+// yielding the CPU whenever all of its rings are empty. The owner sits
+// on its worker's CPU and allocates the shard itself, so the shard's
+// memory is local to that node.
+static void * owner_loop(void *arg) {
+    shard *sh = (shard *) arg;
+    int id = sh - shards;
+    int c;
+
+    if (owner_cpus != NULL) pin_self(owner_cpus[id]);
+    sh->slots = alloc_slots(INITIAL_SLOTS);
+    if (!sh->slots) {
+        panic("out of memory allocating hash table");
+    }
+
+    while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+        int busy = 0;
+        for (c = 0; c < num_clients; c++) {
+            ring *r = &rings[c * num_shards + id];
+            unsigned long head = r->head;
+            unsigned long tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+            if (head == tail) continue;
+            for (; head != tail; head++) {
+                request *req = &r->slots[head & (RING_SIZE - 1)];
+                if (req->op == REQ_INSERT) {
+                    shard_insert(sh, req->hash, req->key, req->val);
+                } else if (req->op == REQ_UPSERT) {
+                    *req->found_out = shard_upsert(sh, req->hash, req->key, req->fn, req->arg);
+                } else {
+                    *req->found_out = shard_lookup(sh, req->hash, req->key, req->val_out);
+                }
+            }
+            __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+            busy = 1;
+        }
+        if (!busy) sched_yield();
+    }
+    return NULL;
+}
+
+// Waits until the owner has applied everything up to seq on ring r
+static void wait_applied(ring *r, unsigned long seq) {
+    while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) < seq) {
+        STAT_ADD(spin_iterations, 1);
+        sched_yield();
+    }
+}
+
+// Waits until the owners have applied everything client c posted
+static void drain_client(int c) {
+    int s;
+    for (s = 0; s < num_shards; s++) {
+        ring *r = &rings[c * num_shards + s];
+        wait_applied(r, r->tail);
+    }
+}
+
+// Thread-exit destructor: drains the thread's rings and frees its slot
+static void release_client(void *arg) {
+    int c = (long) arg - 1;
+    drain_client(c);
+    __atomic_store_n(&client_used[c], 0, __ATOMIC_RELEASE);
+    my_client_generation = 0;
+}
+
+// The calling thread's client slot in this table, or -1 if it holds none.
+// A slot claimed from an earlier table is only told apart by generation.
+static int current_client() {
+    return my_client_generation == client_generation ? my_client : -1;
+}
+
+// Starts an operation: returns the calling thread's client slot, claiming
+// a free one on first use. With none free it takes the overflow slot,
+// which is held until end_client().
+static int begin_client() {
+    int c, expected;
+    if ((c = current_client()) >= 0) return c;
+    for (c = 0; c < num_clients - 1; c++) {
+        if (__atomic_load_n(&client_used[c], __ATOMIC_RELAXED)) continue;
+        expected = 0;
+        if (__atomic_compare_exchange_n(&client_used[c], &expected, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            my_client = c;
+            my_client_generation = client_generation;
+            pthread_setspecific(client_key, (void *) (long) (c + 1));
+            return c;
+        }
+    }
+    if (!__atomic_exchange_n(&overflow_reported, 1, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "# sharded: more than %d client threads, the rest share one "
+                "locked slot\n", num_clients - 1);
+    }
+    pthread_mutex_lock(&overflow_mutex);
+    return num_clients - 1;
+}
+
+// Ends an operation begun on slot c. The overflow slot is drained before
+// it is passed on, so its threads never leave requests behind.
+static void end_client(int c) {
+    if (c != num_clients - 1) return;
+    drain_client(c);
+    pthread_mutex_unlock(&overflow_mutex);
+}
+
+// Returns the next free request slot of ring r, waiting for the owner to
+// make room if the ring is full. It takes effect at publish().
+static request * reserve(ring *r) {
+    unsigned long tail = r->tail;
+    if (tail >= RING_SIZE) wait_applied(r, tail + 1 - RING_SIZE);
+    return &r->slots[tail & (RING_SIZE - 1)];
+}
+
+// Hands the reserved request to the owner and returns its sequence number
+static unsigned long publish(ring *r) {
+    unsigned long tail = r->tail + 1;
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    return tail;
+}
+
+// Posts a request from client c to shard s for key, whose hash is h, and
+// returns its sequence number on the ring
+static unsigned long post(int c, int s, int op, unsigned h, int key, int val, int *val_out,
+                          bool *found_out) {
+    ring *r = &rings[c * num_shards + s];
+    request *req = reserve(r);
+    req->op = op;
+    req->hash = h;
+    req->key = key;
+    req->val = val;
+    req->val_out = val_out;
+    req->found_out = found_out;
+    return publish(r);
+}
+
+// Posts the insert to the key's shard without waiting for it
+static void insert(int key, int val) {
+    unsigned h = ht_hash(key);
+    int c = begin_client();
+    post(c, shard_of(h), REQ_INSERT, h, key, val, NULL, NULL);
+    end_client(c);
+}
+
+// Asks the key's owner for its value and waits for the answer.
+// Returns false if the key isn't in the table.
+static bool retrieve_into(int key, int *val_out) {
+    unsigned h = ht_hash(key);
+    int s = shard_of(h);
+    int c = begin_client();
+    bool found;
+    unsigned long seq = post(c, s, REQ_LOOKUP, h, key, 0, val_out, &found);
+    wait_applied(&rings[c * num_shards + s], seq);
+    end_client(c);
+    return found;
+}
+
+// Has the key's owner apply fn to its value and waits for it to finish
+static bool upsert(int key, ht_update_fn fn, void *arg) {
+    unsigned h = ht_hash(key);
+    int c = begin_client();
+    ring *r = &rings[c * num_shards + shard_of(h)];
+    bool stored;
+    request *req = reserve(r);
+    req->op = REQ_UPSERT;
+    req->hash = h;
+    req->key = key;
+    req->found_out = &stored;
+    req->fn = fn;
+    req->arg = arg;
+    wait_applied(r, publish(r));
+    end_client(c);
+    return stored;
+}
+
+// Posts n inserts without waiting for any of them
+static void insert_batch(const int *batch_keys, const int *batch_vals, size_t n) {
+    size_t k;
+    int c = begin_client();
+    for (k = 0; k < n; k++) {
+        unsigned h = ht_hash(batch_keys[k]);
+        post(c, shard_of(h), REQ_INSERT, h, batch_keys[k], batch_vals[k], NULL, NULL);
+    }
+    end_client(c);
+}
+
+// Looks up n keys, see ht_backend. All lookups are posted before
+// waiting, so the owners answer them in parallel.
+static size_t retrieve_batch(const int *batch_keys, int *vals_out, bool *found, size_t n) {
+    size_t k, hits = 0;
+    int c = begin_client();
+    for (k = 0; k < n; k++) {
+        unsigned h = ht_hash(batch_keys[k]);
+        post(c, shard_of(h), REQ_LOOKUP, h, batch_keys[k], 0, &vals_out[k], &found[k]);
+    }
+    if (n > 0) drain_client(c);
+    end_client(c);
+    for (k = 0; k < n; k++) {
+        hits += found[k];
+    }
+    return hits;
+}
+
+// Waits until the owners have applied every insert the calling thread posted
+static void flush(void) {
+    int c = current_client();
+    if (c >= 0) drain_client(c);
+}
+
+// Sets up one shard and one owner thread per configured thread, each
+// owner pinned next to its worker if cfg->cpus is set
+static void init(const ht_config *cfg) {
+    int i;
+    num_shards = cfg->num_threads;
+    num_clients = cfg->num_threads * CLIENTS_PER_THREAD + 1;
+    stop = 0;
+    overflow_reported = 0;
+    client_generation++;
+    owner_cpus = cfg->cpus;
+
+    shards = aligned_alloc(CACHE_LINE, sizeof(shard) * num_shards);
+    rings = aligned_alloc(CACHE_LINE, sizeof(ring) * num_clients * num_shards);
+    client_used = calloc(num_clients, sizeof(int));
+    if (!shards || !rings || !client_used) {
+        panic("out of memory allocating shards");
+    }
+    memset(rings, 0, sizeof(ring) * num_clients * num_shards);
+    if (pthread_key_create(&client_key, release_client) != 0) {
+        panic("cannot create client key");
+    }
+    pthread_mutex_init(&overflow_mutex, NULL);
+
+    for (i = 0; i < num_shards; i++) {
+        shards[i].capacity = INITIAL_SLOTS;
+        shards[i].count = 0;
+        shards[i].has_empty_key = 0;
+        if (pthread_create(&shards[i].owner, NULL, owner_loop, &shards[i]) != 0) {
+            panic("cannot start shard owner");
+        }
+    }
+}
+
+// Memory footprint, see ht_mem_stats, counted as in parallel_probe.c.
+// The caller has flushed, so the owners are only polling their rings.
+static void mem_stats(ht_mem_stats *out) {
+    int i;
+    long j;
+    memset(out, 0, sizeof(*out));
+    out->index_bytes = sizeof(shard) * num_shards + sizeof(ring) * num_clients * num_shards;
+    out->overhead_bytes = ht_alloc_overhead(shards, sizeof(shard) * num_shards) +
+                          ht_alloc_overhead(rings, sizeof(ring) * num_clients * num_shards);
+    for (i = 0; i < num_shards; i++) {
+        shard *sh = &shards[i];
+        out->keys += sh->count + sh->has_empty_key;
+        out->entry_bytes += sizeof(slot) * sh->count;
+        out->overhead_bytes += sizeof(slot) * (sh->capacity - sh->count) +
+                               ht_alloc_overhead(sh->slots, sizeof(slot) * sh->capacity);
+        for (j = 0; j < sh->capacity; j++) {
+            if (sh->slots[j].key == EMPTY_KEY) continue;
+            ht_count_chain(out, (j - (ht_hash(sh->slots[j].key) & (sh->capacity - 1))) &
+                                (sh->capacity - 1));
+        }
+    }
+}
+
+static void destroy(void) {
+    int i;
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < num_shards; i++) {
+        pthread_join(shards[i].owner, NULL);
+        free(shards[i].slots);
+    }
+    pthread_key_delete(client_key);
+    pthread_mutex_destroy(&overflow_mutex);
+    free(shards);
+    free(rings);
+    free(client_used);
+}
+
+const ht_backend sharded_backend = {
+    .name = "sharded",
+    .init = init,
+    .insert = insert,
+    .retrieve_into = retrieve_into,
+    .insert_batch = insert_batch,
+    .retrieve_batch = retrieve_batch,
+    .upsert = upsert,
+    .flush = flush,
+    .mem_stats = mem_stats,
+    .destroy = destroy,
+};
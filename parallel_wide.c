@@ -0,0 +1,133 @@
+// Striped chained table with 64-bit keys and struct values, behind the
+// int interface every backend has. Each int key is widened so its bits
+// show up in both halves, and each value is stored with a check word
+// that every read verifies, so a run over this backend covers the
+// template with a key and a value that aren't plain ints.
+#include <stdint.h>
+
+#include "hashtable.h"
+
+#define BATCH_SIZE 64     // Keys widened per batch call, the template's round size
+
+typedef struct wide_val {
+    int val;
+    int check;            // ~val, checked on every read
+} wide_val;
+
+static inline uint64_t widen(int key) {
+    return (uint64_t) (unsigned) key << 32 | (unsigned) ~key;
+}
+
+// The high half is the int key, so this spreads keys as every other
+// table does in either hash mode; the low half only takes part in key
+// equality
+static inline unsigned wide_hash(uint64_t k) {
+    return ht_hash((int) (k >> 32));
+}
+
+#define HT_PREFIX tbl
+#define HT_POLICY HT_POLICY_MUTEX
+#define HT_KEY uint64_t
+#define HT_VAL wide_val
+#define HT_HASH(k) wide_hash(k)
+#include "ht_template.h"
+
+static inline wide_val make_val(int val) {
+    wide_val v = {val, ~val};
+    return v;
+}
+
+static inline int unwrap(wide_val v) {
+    if (v.check != ~v.val) panic("wide value corrupted!");
+    return v.val;
+}
+
+static void wide_insert(int key, int val) {
+    tbl_insert(widen(key), make_val(val));
+}
+
+static bool wide_retrieve_into(int key, int *val_out) {
+    wide_val v;
+    if (!tbl_retrieve_into(widen(key), &v)) return false;
+    *val_out = unwrap(v);
+    return true;
+}
+
+static void wide_insert_batch(const int *batch_keys, const int *batch_vals, size_t n) {
+    uint64_t keys[BATCH_SIZE];
+    wide_val vals[BATCH_SIZE];
+    size_t done, k;
+    for (done = 0; done < n; done += BATCH_SIZE) {
+        size_t count = n - done < BATCH_SIZE ? n - done : BATCH_SIZE;
+        for (k = 0; k < count; k++) {
+            keys[k] = widen(batch_keys[done + k]);
+            vals[k] = make_val(batch_vals[done + k]);
+        }
+        tbl_insert_batch(keys, vals, count);
+    }
+}
+
+static size_t wide_retrieve_batch(const int *batch_keys, int *vals_out, bool *found, size_t n) {
+    uint64_t keys[BATCH_SIZE];
+    wide_val vals[BATCH_SIZE];
+    size_t done, k, hits = 0;
+    for (done = 0; done < n; done += BATCH_SIZE) {
+        size_t count = n - done < BATCH_SIZE ? n - done : BATCH_SIZE;
+        for (k = 0; k < count; k++) {
+            keys[k] = widen(batch_keys[done + k]);
+        }
+        hits += tbl_retrieve_batch(keys, vals, found + done, count);
+        for (k = 0; k < count; k++) {
+            if (found[done + k]) vals_out[done + k] = unwrap(vals[k]);
+        }
+    }
+    return hits;
+}
+
+// Runs the caller's int update on the struct value
+typedef struct wide_update {
+    ht_update_fn fn;
+    void *arg;
+} wide_update;
+
+static bool wide_step(wide_val *v, bool found, void *arg) {
+    wide_update *u = arg;
+    int val = found ? unwrap(*v) : 0;
+    if (!u->fn(&val, found, u->arg)) return false;
+    *v = make_val(val);
+    return true;
+}
+
+static bool wide_upsert(int key, ht_update_fn fn, void *arg) {
+    wide_update u = {fn, arg};
+    return tbl_upsert(widen(key), wide_step, &u);
+}
+
+static void wide_build(const ht_config *cfg, const int *keys, const int *vals, size_t n) {
+    uint64_t *wide_keys = malloc(sizeof(uint64_t) * (n > 0 ? n : 1));
+    wide_val *wide_vals = malloc(sizeof(wide_val) * (n > 0 ? n : 1));
+    size_t i;
+    if (!wide_keys || !wide_vals) {
+        panic("out of memory for bulk build");
+    }
+    for (i = 0; i < n; i++) {
+        wide_keys[i] = widen(keys[i]);
+        wide_vals[i] = make_val(vals[i]);
+    }
+    tbl_build(cfg, wide_keys, wide_vals, n);
+    free(wide_keys);
+    free(wide_vals);
+}
+
+const ht_backend wide_backend = {
+    .name = "wide",
+    .init = tbl_init,
+    .insert = wide_insert,
+    .retrieve_into = wide_retrieve_into,
+    .insert_batch = wide_insert_batch,
+    .retrieve_batch = wide_retrieve_batch,
+    .upsert = wide_upsert,
+    .build = wide_build,
+    .mem_stats = tbl_mem_stats,
+    .destroy = tbl_destroy,
+};